@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "task-pool/task-pool.h"
+
+/* a million tasks counted in one completion, first a TaskCompletion that
+ * every spawn and finish writes, then a ShardedCompletion. Half the tasks are
+ * spawned by tasks so the workers spawn as well as finish */
+namespace {
+
+enum {
+    kNumBranches = 500 * 1000,
+};
+
+struct FanOut {
+    TaskPool* pool;
+    TaskCompletion* completion;
+    ShardedCompletion* sharded;
+};
+
+void _Leaf(int, void*)
+{
+}
+void _Branch(int, void* data)
+{
+    FanOut const* fan_out = (FanOut const*)data;
+    if (fan_out->sharded) {
+        tpSpawnShardedTask(fan_out->pool, _Leaf, nullptr, fan_out->sharded);
+    } else {
+        tpSpawnTask(fan_out->pool, _Leaf, nullptr, fan_out->completion);
+    }
+}
+
+double _Run(TaskPool* pool, bool sharded)
+{
+    TaskCompletion completion = 0;
+    FanOut const fan_out = { pool, &completion, sharded ? tpCreateShardedCompletion(pool) : nullptr };
+    auto const start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < kNumBranches; ++ii) {
+        if (sharded) {
+            tpSpawnShardedTask(pool, _Branch, (void*)&fan_out, fan_out.sharded);
+        } else {
+            tpSpawnTask(pool, _Branch, (void*)&fan_out, &completion);
+        }
+    }
+    if (sharded) {
+        tpWaitForShardedCompletion(pool, fan_out.sharded);
+    } else {
+        tpWaitForCompletion(pool, &completion);
+    }
+    auto const end = std::chrono::steady_clock::now();
+    tpDestroyShardedCompletion(pool, fan_out.sharded);
+    return std::chrono::duration<double>(end - start).count();
+}
+
+} // anonymous namespace
+
+int main(void)
+{
+    int const num_cpus = (int)std::thread::hardware_concurrency();
+    TaskPool* pool = tpCreatePool(num_cpus > 1 ? num_cpus - 1 : 1, nullptr);
+
+    double const total_tasks = 2.0 * kNumBranches;
+    for (int ii = 0; ii < 3; ++ii) {
+        double const single = _Run(pool, false);
+        printf("TaskCompletion:     %8.3f s  %12.0f tasks/s\n", single, total_tasks / single);
+        double const sharded = _Run(pool, true);
+        printf("ShardedCompletion:  %8.3f s  %12.0f tasks/s\n", sharded, total_tasks / sharded);
+    }
+
+    tpDestroyPool(pool);
+    return 0;
+}
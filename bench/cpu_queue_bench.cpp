@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "task-pool/task-pool.h"
+
+/* per-thread queues against per-CPU queues with four times as many workers as
+ * CPUs, plus threads the pool didn't create that spawn task trees of their
+ * own. Each push and pop of a CPU queue pays an atomic exchange for
+ * ownership on top of the queue's own cost */
+namespace {
+
+enum {
+    kOversubscription = 4,
+    kNumProducers = 8,
+    kTreeDepth = 6,
+    kTreesPerProducer = 20,
+    kTasksPerTree = (1 << (2 * (kTreeDepth + 1))) / 3, // 1 + 4 + ... + 4^depth
+};
+
+struct Node {
+    TaskPool* pool;
+    int depth;
+};
+
+void _TreeTask(int, void* data)
+{
+    Node const* node = (Node const*)data;
+    if (node->depth == 0) {
+        return;
+    }
+    Node children[4];
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 4; ++ii) {
+        children[ii] = { node->pool, node->depth - 1 };
+        tpSpawnTask(node->pool, _TreeTask, &children[ii], &completion);
+    }
+    tpWaitForCompletion(node->pool, &completion);
+}
+
+double _RunProducers(TaskPool* pool)
+{
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (int ii = 0; ii < kNumProducers; ++ii) {
+        producers.push_back(std::thread([pool]() {
+            tpRegisterThread(pool);
+            for (int jj = 0; jj < kTreesPerProducer; ++jj) {
+                Node root = { pool, kTreeDepth };
+                TaskCompletion completion = 0;
+                tpSpawnTask(pool, _TreeTask, &root, &completion);
+                tpWaitForCompletion(pool, &completion);
+            }
+            tpUnregisterThread(pool);
+        }));
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    auto const end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+void _Run(char const* name, int per_cpu_queues)
+{
+    int const num_cpus = (int)std::thread::hardware_concurrency();
+    TaskPoolCreateInfo info = {};
+    info.num_threads = kOversubscription * (num_cpus > 0 ? num_cpus : 1);
+    info.max_external_threads = kNumProducers;
+    info.per_cpu_queues = per_cpu_queues;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    if (per_cpu_queues && tpNumCpuQueues(pool) == 0) {
+        printf("%-18s  unavailable\n", name);
+        tpDestroyPool(pool);
+        return;
+    }
+
+    double const total_tasks = (double)kNumProducers * kTreesPerProducer * kTasksPerTree;
+    double const seconds = _RunProducers(pool);
+    printf("%-18s  %8.3f s  %12.0f tasks/s\n", name, seconds, total_tasks / seconds);
+    tpDestroyPool(pool);
+}
+
+} // anonymous namespace
+
+int main(void)
+{
+    for (int ii = 0; ii < 3; ++ii) {
+        _Run("per-thread queues", 0);
+        _Run("per-CPU queues", 1);
+    }
+    return 0;
+}
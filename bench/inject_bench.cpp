@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "task-pool/task-pool.h"
+
+/* 16 threads the pool didn't create feed a 32 worker pool, either through the
+ * injection queue or through their own registered queues */
+namespace {
+
+enum {
+    kNumWorkers = 32,
+    kNumProducers = 16,
+    kTasksPerProducer = 100 * 1000,
+};
+
+void _CountTask(int, void* data)
+{
+    ((std::atomic<int>*)data)->fetch_add(1, std::memory_order_relaxed);
+}
+
+double _RunProducers(TaskPool* pool, bool registered)
+{
+    std::atomic<int> counter = {0};
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (int ii = 0; ii < kNumProducers; ++ii) {
+        producers.push_back(std::thread([pool, registered, &counter]() {
+            TaskCompletion completion = 0;
+            if (registered) {
+                tpRegisterThread(pool);
+                for (int jj = 0; jj < kTasksPerProducer; ++jj) {
+                    tpSpawnTask(pool, _CountTask, &counter, &completion);
+                }
+                tpWaitForCompletion(pool, &completion);
+                tpUnregisterThread(pool);
+            } else {
+                for (int jj = 0; jj < kTasksPerProducer; ++jj) {
+                    tpInjectTask(pool, _CountTask, &counter, &completion);
+                }
+                while (completion) {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    auto const end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+} // anonymous namespace
+
+int main(void)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = kNumWorkers;
+    info.max_external_threads = kNumProducers;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+
+    double const total_tasks = (double)kNumProducers * kTasksPerProducer;
+    double const injected = _RunProducers(pool, false);
+    printf("inject queue:       %8.3f s  %12.0f tasks/s\n", injected, total_tasks / injected);
+    double const registered = _RunProducers(pool, true);
+    printf("registered queues:  %8.3f s  %12.0f tasks/s\n", registered, total_tasks / registered);
+
+    tpDestroyPool(pool);
+    return 0;
+}
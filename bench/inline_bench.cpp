@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+
+#include "task-pool/task-pool.h"
+
+/* naive recursive Fibonacci that spawns every call, without a cutoff, first
+ * always queueing and then with inline spawns once queues are deep */
+namespace {
+
+enum {
+    kFibonacci = 25,
+};
+
+struct Fib {
+    TaskPool* pool;
+    int n;
+    long result;
+};
+
+void _Fib(int, void* data)
+{
+    Fib* fib = (Fib*)data;
+    if (fib->n < 2) {
+        fib->result = fib->n;
+        return;
+    }
+    Fib children[2] = {
+        { fib->pool, fib->n - 1, 0 },
+        { fib->pool, fib->n - 2, 0 },
+    };
+    TaskCompletion completion = 0;
+    tpSpawnTask(fib->pool, _Fib, &children[0], &completion);
+    tpSpawnTask(fib->pool, _Fib, &children[1], &completion);
+    tpWaitForCompletion(fib->pool, &completion);
+    fib->result = children[0].result + children[1].result;
+}
+
+double _Run(TaskPool* pool, long* result)
+{
+    Fib root = { pool, kFibonacci, 0 };
+    TaskCompletion completion = 0;
+    auto const start = std::chrono::steady_clock::now();
+    tpSpawnTask(pool, _Fib, &root, &completion);
+    tpWaitForCompletion(pool, &completion);
+    auto const end = std::chrono::steady_clock::now();
+    *result = root.result;
+    return std::chrono::duration<double>(end - start).count();
+}
+
+} // anonymous namespace
+
+int main(void)
+{
+    int const num_cpus = (int)std::thread::hardware_concurrency();
+    TaskPool* pool = tpCreatePool(num_cpus > 1 ? num_cpus - 1 : 1, nullptr);
+
+    InlineSpawnInfo const info = { 8, 64 };
+    for (int ii = 0; ii < 3; ++ii) {
+        long result = 0;
+        tpSetInlineSpawn(pool, nullptr);
+        double const queued = _Run(pool, &result);
+        printf("always queue:   %8.3f s  fib(%d) = %ld\n", queued, kFibonacci, result);
+        tpSetInlineSpawn(pool, &info);
+        double const inlined = _Run(pool, &result);
+        printf("inline spawns:  %8.3f s  fib(%d) = %ld\n", inlined, kFibonacci, result);
+    }
+
+    tpDestroyPool(pool);
+    return 0;
+}
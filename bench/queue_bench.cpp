@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+#include "../src/task-queue.hpp"
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #define LegacyCompareAndSwap(addr, desired, expected) _InterlockedCompareExchange64(addr, desired, expected)
+#else
+    #define LegacyCompareAndSwap(addr, desired, expected) __sync_val_compare_and_swap(addr, expected, desired)
+#endif
+
+/* owner-side cost of the std::atomic TaskQueue against the volatile and
+ * __sync based one it replaced, which is kept here for comparison, and of
+ * its two fence modes */
+namespace {
+
+enum {
+    kQueueSize = 1024,
+    kBatchSize = kQueueSize / 2,
+    kNumIterations = 20 * 1000,
+};
+
+template<uint32_t kMaxCount>
+class LegacyTaskQueue {
+public:
+    int64_t size()const
+    {
+        return this->_bottom - this->_top;
+    }
+    int push(struct Task* value)
+    {
+        if (this->size() == kMaxCount) {
+            return 1;
+        }
+        int64_t const bottom = this->_bottom;
+        this->_data[bottom & kQueueMask] = value;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        this->_bottom = bottom + 1;
+        return 0;
+    }
+    Task* pop()
+    {
+        int64_t bottom = this->_bottom - 1;
+        this->_bottom = bottom;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = this->_top;
+        if (top <= bottom) {
+            struct Task* value = this->_data[bottom & kQueueMask];
+            if (top != bottom) {
+                return value;
+            }
+            if (LegacyCompareAndSwap(&this->_top, top + 1, top) != top) {
+                value = NULL;
+            }
+            this->_bottom = top + 1;
+            return value;
+        } else {
+            this->_bottom = top;
+            return NULL;
+        }
+    }
+    Task* steal()
+    {
+        int64_t top = this->_top;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        int64_t bottom = this->_bottom;
+        if (top < bottom) {
+            struct Task* value = this->_data[top & kQueueMask];
+            if (LegacyCompareAndSwap(&this->_top, top + 1, top) != top) {
+                return NULL;
+            }
+            return value;
+        } else {
+            return NULL;
+        }
+    }
+
+private:
+    enum {
+        kQueueMask = kMaxCount - 1,
+    };
+    struct Task*        _data[kMaxCount] = {nullptr};
+    volatile int64_t    _top = 0;
+    volatile int64_t    _bottom = 0;
+};
+
+/* pushes a batch, then pops it back */
+template<typename Queue>
+double _BatchedNsPerOp(Queue* queue)
+{
+    uintptr_t sum = 0;
+    auto const start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < kNumIterations; ++ii) {
+        for (int jj = 0; jj < kBatchSize; ++jj) {
+            queue->push((struct Task*)(uintptr_t)(jj + 1));
+        }
+        for (int jj = 0; jj < kBatchSize; ++jj) {
+            sum += (uintptr_t)queue->pop();
+        }
+    }
+    auto const end = std::chrono::steady_clock::now();
+    if (sum == 0) {
+        printf("unexpected\n");
+    }
+    double const num_ops = 2.0 * kNumIterations * kBatchSize;
+    return std::chrono::duration<double, std::nano>(end - start).count() / num_ops;
+}
+
+/* pushes and pops one item at a time, so every pop takes the last item */
+template<typename Queue>
+double _AlternatingNsPerOp(Queue* queue)
+{
+    uintptr_t sum = 0;
+    auto const start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < kNumIterations * kBatchSize / 8; ++ii) {
+        queue->push((struct Task*)(uintptr_t)(ii + 1));
+        sum += (uintptr_t)queue->pop();
+    }
+    auto const end = std::chrono::steady_clock::now();
+    if (sum == 0) {
+        printf("unexpected\n");
+    }
+    double const num_ops = 2.0 * kNumIterations * kBatchSize / 8;
+    return std::chrono::duration<double, std::nano>(end - start).count() / num_ops;
+}
+
+/* owner push/pop batches while another thread keeps stealing, pausing
+ * between steals when steal_pause_us isn't 0. Also reports how long a steal
+ * attempt took on average */
+template<typename Queue>
+double _ContendedNsPerOp(Queue* queue, int steal_pause_us, double* ns_per_steal)
+{
+    std::atomic<bool> done = {false};
+    double steal_ns = 0.0;
+    std::thread thief([queue, &done, steal_pause_us, &steal_ns]() {
+        double total = 0.0;
+        int64_t count = 0;
+        while (!done.load(std::memory_order_relaxed)) {
+            auto const start = std::chrono::steady_clock::now();
+            queue->steal();
+            total += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            ++count;
+            if (steal_pause_us) {
+                std::this_thread::sleep_for(std::chrono::microseconds(steal_pause_us));
+            }
+        }
+        steal_ns = count ? total / (double)count : 0.0;
+    });
+    double const result = _BatchedNsPerOp(queue);
+    done = true;
+    thief.join();
+    if (ns_per_steal) {
+        *ns_per_steal = steal_ns;
+    }
+    return result;
+}
+
+/* C++11 new ignores the queue's cache line alignment */
+template<typename Queue>
+Queue* _CreateQueue()
+{
+    alignas(64) static char storage[sizeof(Queue)];
+    return new (storage) Queue;
+}
+
+template<typename Queue>
+void _Run(char const* name)
+{
+    Queue* queue = _CreateQueue<Queue>();
+    double const batched = _BatchedNsPerOp(queue);
+    double const alternating = _AlternatingNsPerOp(queue);
+    double const contended = _ContendedNsPerOp(queue, 0, nullptr);
+    printf("%-12s  batched %6.2f ns/op  alternating %6.2f ns/op  with thief %6.2f ns/op\n",
+           name, batched, alternating, contended);
+    queue->~Queue();
+}
+
+/* the fence mode trades owner cost for thief cost, so report both with a
+ * thief that steals back to back and one that steals every 100us */
+void _RunFences(char const* name, bool asymmetric)
+{
+    TaskQueue<kQueueSize>* queue = _CreateQueue<TaskQueue<kQueueSize>>();
+    queue->set_asymmetric_fences(asymmetric);
+    double const alternating = _AlternatingNsPerOp(queue);
+    double heavy_steal = 0.0;
+    double const heavy = _ContendedNsPerOp(queue, 0, &heavy_steal);
+    double light_steal = 0.0;
+    double const light = _ContendedNsPerOp(queue, 100, &light_steal);
+    printf("%-12s  alternating %6.2f ns/op  steal-heavy %6.2f ns/op (%8.1f ns/steal)"
+           "  steal-light %6.2f ns/op (%8.1f ns/steal)\n",
+           name, alternating, heavy, heavy_steal, light, light_steal);
+    queue->~TaskQueue<kQueueSize>();
+}
+
+} // anonymous namespace
+
+int main(void)
+{
+    for (int ii = 0; ii < 3; ++ii) {
+        _Run<LegacyTaskQueue<kQueueSize>>("volatile");
+        _Run<TaskQueue<kQueueSize>>("std::atomic");
+    }
+    bool const have_heavy_fence = RegisterHeavyFence();
+    for (int ii = 0; ii < 3; ++ii) {
+        _RunFences("symmetric", false);
+        if (have_heavy_fence) {
+            _RunFences("asymmetric", true);
+        }
+    }
+    if (!have_heavy_fence) {
+        printf("membarrier is unavailable, skipping asymmetric fences\n");
+    }
+    return 0;
+}
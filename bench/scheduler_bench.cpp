@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+
+#include "task-pool/task-pool.h"
+
+/* the same task trees under every combination of victim, idle and wake
+ * policy, with short pauses between the trees so idle workers go to sleep
+ * and have to be woken. Then a spawn-heavy run under each combination, with
+ * batches of empty tasks and a naive Fibonacci that spawns one call and
+ * waits for it, where the cost of a spawn and a helping wait dominates */
+namespace {
+
+enum {
+    kTreeDepth = 6,
+    kNumTrees = 50,
+    kPauseUs = 200,
+    kNumBatches = 200,
+    kBatchSize = 512,
+    kFibonacci = 20,
+};
+
+struct Node {
+    TaskPool* pool;
+    int depth;
+};
+
+void _TreeTask(int, void* data)
+{
+    Node const* node = (Node const*)data;
+    if (node->depth == 0) {
+        return;
+    }
+    Node children[4];
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 4; ++ii) {
+        children[ii] = { node->pool, node->depth - 1 };
+        tpSpawnTask(node->pool, _TreeTask, &children[ii], &completion);
+    }
+    tpWaitForCompletion(node->pool, &completion);
+}
+
+struct Fib {
+    TaskPool* pool;
+    int n;
+    long result;
+};
+void _FibTask(int, void* data)
+{
+    Fib* fib = (Fib*)data;
+    if (fib->n < 2) {
+        fib->result = fib->n;
+        return;
+    }
+    Fib a = { fib->pool, fib->n - 1, 0 };
+    Fib b = { fib->pool, fib->n - 2, 0 };
+    TaskCompletion completion = 0;
+    tpSpawnTask(fib->pool, _FibTask, &a, &completion);
+    _FibTask(0, &b);
+    tpWaitForCompletion(fib->pool, &completion);
+    fib->result = a.result + b.result;
+}
+
+double _RunTrees(TaskPoolCreateInfo const* info)
+{
+    TaskPool* pool = tpCreatePoolWithInfo(info);
+    auto const start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < kNumTrees; ++ii) {
+        Node root = { pool, kTreeDepth };
+        TaskCompletion completion = 0;
+        tpSpawnTask(pool, _TreeTask, &root, &completion);
+        tpWaitForCompletion(pool, &completion);
+        std::this_thread::sleep_for(std::chrono::microseconds(kPauseUs));
+    }
+    auto const end = std::chrono::steady_clock::now();
+    tpDestroyPool(pool);
+    return std::chrono::duration<double>(end - start).count();
+}
+
+double _RunSpawns(TaskPoolCreateInfo const* info)
+{
+    TaskPool* pool = tpCreatePoolWithInfo(info);
+    auto const start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < kNumBatches; ++ii) {
+        TaskCompletion completion = 0;
+        for (int jj = 0; jj < kBatchSize; ++jj) {
+            tpSpawnTask(pool, [](int, void*) {}, nullptr, &completion);
+        }
+        tpWaitForCompletion(pool, &completion);
+    }
+    Fib fib = { pool, kFibonacci, 0 };
+    _FibTask(0, &fib);
+    auto const end = std::chrono::steady_clock::now();
+    tpDestroyPool(pool);
+    if (fib.result != 6765) {
+        printf("WRONG RESULT\n");
+    }
+    return std::chrono::duration<double>(end - start).count();
+}
+
+template<typename Run>
+double _Best(Run const& run, TaskPoolCreateInfo const* info)
+{
+    double best = 0.0;
+    for (int ii = 0; ii < 3; ++ii) {
+        double const seconds = run(info);
+        best = ii == 0 || seconds < best ? seconds : best;
+    }
+    return best;
+}
+
+} // anonymous namespace
+
+int main(void)
+{
+    static char const* const victim_names[] = { "round-robin", "random" };
+    static char const* const idle_names[] = { "sleep", "spin" };
+    static char const* const wake_names[] = { "wake-all", "wake-one" };
+    int const num_cpus = (int)std::thread::hardware_concurrency();
+
+    for (int policies = 0; policies < 8; ++policies) {
+        TaskPoolCreateInfo info = {};
+        info.num_threads = num_cpus > 1 ? num_cpus - 1 : 1;
+        info.victim_policy = policies & 1;
+        info.idle_policy = (policies >> 1) & 1;
+        info.wake_policy = (policies >> 2) & 1;
+        double const trees = _Best(_RunTrees, &info);
+        double const spawns = _Best(_RunSpawns, &info);
+        printf("%-11s  %-5s  %-8s  trees %8.3f s  spawns %8.3f s\n",
+               victim_names[info.victim_policy], idle_names[info.idle_policy],
+               wake_names[info.wake_policy], trees, spawns);
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "task-pool/task-pool.h"
+
+/* help-first against work-first forks on three recursive kernels: naive
+ * Fibonacci, counting N-queens solutions by splitting the columns of each row
+ * in halves, and quicksort. Every kernel forks without a manual cutoff except
+ * quicksort, which sorts small ranges serially */
+namespace {
+
+enum {
+    kFibonacci = 25,
+    kQueens = 10,
+    kQueensSolutions = 724,
+    kSortSize = 1 << 20,
+    kSortCutoff = 1024,
+};
+
+TaskPool* _pool = nullptr;
+int _policy = kSpawnHelpFirst;
+
+/* fork and wait for both halves */
+void _Fork(TaskFunction* child, void* child_data,
+           TaskFunction* continuation, void* continuation_data)
+{
+    TaskCompletion completion = 0;
+    tpForkTaskWithPolicy(_pool, child, child_data, continuation, continuation_data,
+                         &completion, _policy);
+    tpWaitForCompletion(_pool, &completion);
+}
+
+struct Fib {
+    int n;
+    long result;
+};
+void _Fib(int, void* data)
+{
+    Fib* fib = (Fib*)data;
+    if (fib->n < 2) {
+        fib->result = fib->n;
+        return;
+    }
+    Fib a = { fib->n - 1, 0 };
+    Fib b = { fib->n - 2, 0 };
+    _Fork(_Fib, &a, _Fib, &b);
+    fib->result = a.result + b.result;
+}
+
+/* places a queen in row on every column in [first, last) that isn't attacked */
+struct Queens {
+    int columns[kQueens]; // column of the queen in each row before row
+    int row;
+    int first;
+    int last;
+    long result;
+};
+bool _IsFree(Queens const* queens, int column)
+{
+    for (int ii = 0; ii < queens->row; ++ii) {
+        int const distance = queens->row - ii;
+        if (queens->columns[ii] == column ||
+            queens->columns[ii] == column - distance ||
+            queens->columns[ii] == column + distance) {
+            return false;
+        }
+    }
+    return true;
+}
+void _Queens(int, void* data)
+{
+    Queens* queens = (Queens*)data;
+    queens->result = 0;
+    if (queens->last - queens->first > 1) {
+        int const middle = (queens->first + queens->last) / 2;
+        Queens left = *queens;
+        Queens right = *queens;
+        left.last = middle;
+        right.first = middle;
+        _Fork(_Queens, &left, _Queens, &right);
+        queens->result = left.result + right.result;
+        return;
+    }
+    if (!_IsFree(queens, queens->first)) {
+        return;
+    }
+    if (queens->row == kQueens - 1) {
+        queens->result = 1;
+        return;
+    }
+    Queens next = *queens;
+    next.columns[queens->row] = queens->first;
+    next.row = queens->row + 1;
+    next.first = 0;
+    next.last = kQueens;
+    _Queens(0, &next);
+    queens->result = next.result;
+}
+
+struct Sort {
+    int* begin;
+    int* end;
+};
+void _Sort(int, void* data)
+{
+    Sort const* sort = (Sort const*)data;
+    if (sort->end - sort->begin <= kSortCutoff) {
+        std::sort(sort->begin, sort->end);
+        return;
+    }
+    int const pivot = sort->begin[(sort->end - sort->begin) / 2];
+    int* const middle = std::partition(sort->begin, sort->end, [pivot](int value) {
+        return value < pivot;
+    });
+    int* const upper = std::partition(middle, sort->end, [pivot](int value) {
+        return value == pivot;
+    });
+    Sort left = { sort->begin, middle };
+    Sort right = { upper, sort->end };
+    _Fork(_Sort, &left, _Sort, &right);
+}
+
+template<typename Kernel>
+double _Time(Kernel const& kernel)
+{
+    auto const start = std::chrono::steady_clock::now();
+    kernel();
+    auto const end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+void _Run(char const* name)
+{
+    Fib fib = { kFibonacci, 0 };
+    double const fib_seconds = _Time([&]() { _Fib(0, &fib); });
+
+    Queens queens;
+    memset(&queens, 0, sizeof(queens));
+    queens.last = kQueens;
+    double const queens_seconds = _Time([&]() { _Queens(0, &queens); });
+
+    std::vector<int> values(kSortSize);
+    uint32_t state = 12345;
+    for (int& value : values) {
+        state = state * 1664525u + 1013904223u;
+        value = (int)(state >> 8);
+    }
+    Sort sort = { values.data(), values.data() + values.size() };
+    double const sort_seconds = _Time([&]() { _Sort(0, &sort); });
+
+    bool const ok = fib.result == 75025 && queens.result == kQueensSolutions &&
+                    std::is_sorted(values.begin(), values.end());
+    printf("%-11s  fib %8.3f s  nqueens %8.3f s  quicksort %8.3f s%s\n", name,
+           fib_seconds, queens_seconds, sort_seconds, ok ? "" : "  WRONG RESULT");
+}
+
+} // anonymous namespace
+
+int main(void)
+{
+    int const num_cpus = (int)std::thread::hardware_concurrency();
+    _pool = tpCreatePool(num_cpus > 1 ? num_cpus - 1 : 1, nullptr);
+
+    for (int ii = 0; ii < 3; ++ii) {
+        _policy = kSpawnHelpFirst;
+        _Run("help-first");
+        _policy = kSpawnWorkFirst;
+        _Run("work-first");
+    }
+
+    tpDestroyPool(_pool);
+    return 0;
+}
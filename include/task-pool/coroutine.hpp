@@ -0,0 +1,371 @@
+#pragma once
+#include <stdlib.h>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "task-pool/task-pool.h"
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+/* C++20 coroutine layer over the task pool.
+ *
+ *  tp::task<int> Compute(TaskPool* pool, int value)
+ *  {
+ *      co_await tp::schedule(pool); // continue on a pool thread
+ *      co_return value * 2;
+ *  }
+ *
+ * Tasks are lazy: they start when awaited and resume their awaiter through
+ * symmetric transfer, so long co_await chains don't grow the stack. A
+ * coroutine whose first parameter is a TaskPool* allocates its frame through
+ * that pool's AllocationCallbacks. Suspended coroutines don't hold on to a
+ * thread; they are resumed by a pool task once there is something to do.
+ */
+namespace tp {
+
+template<typename T = void> class task;
+
+namespace detail {
+
+inline int completion_add(TaskCompletion* completion, int value)
+{
+#if defined(_MSC_VER)
+    return _InterlockedExchangeAdd((volatile long*)completion, value) + value;
+#else
+    return __sync_add_and_fetch(completion, value);
+#endif
+}
+
+/* every frame is prefixed with the allocator it came from, NULL for malloc */
+enum {
+    kFrameHeaderSize = alignof(std::max_align_t),
+};
+inline void* allocate_frame(size_t size, AllocationCallbacks const* allocator)
+{
+    size_t const total_size = size + kFrameHeaderSize;
+    void* memory = nullptr;
+    if (allocator) {
+        memory = allocator->allocate_function(total_size, allocator->user_data);
+    } else {
+        memory = malloc(total_size);
+    }
+    if (memory == nullptr) {
+        std::terminate();
+    }
+    *(AllocationCallbacks const**)memory = allocator;
+    return (char*)memory + kFrameHeaderSize;
+}
+inline void free_frame(void* frame)
+{
+    void* const memory = (char*)frame - kFrameHeaderSize;
+    AllocationCallbacks const* allocator = *(AllocationCallbacks const**)memory;
+    if (allocator) {
+        allocator->free_function(memory, allocator->user_data);
+    } else {
+        free(memory);
+    }
+}
+
+struct promise_allocation {
+    static void* operator new(size_t size)
+    {
+        return allocate_frame(size, nullptr);
+    }
+    template<typename... Args>
+    static void* operator new(size_t size, TaskPool* pool, Args const&...)
+    {
+        return allocate_frame(size, tpGetAllocator(pool));
+    }
+    static void operator delete(void* frame)
+    {
+        free_frame(frame);
+    }
+};
+
+struct task_promise_base : promise_allocation {
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> const continuation = handle.promise().continuation;
+            if (continuation) {
+                return continuation;
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() const noexcept { std::terminate(); }
+
+    std::coroutine_handle<> continuation;
+};
+
+template<typename T>
+struct task_promise : task_promise_base {
+    task<T> get_return_object() noexcept;
+    template<typename U>
+    void return_value(U&& value) { this->result.emplace(std::forward<U>(value)); }
+
+    std::optional<T> result;
+};
+
+template<>
+struct task_promise<void> : task_promise_base {
+    task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+};
+
+/* eagerly started coroutine that signals a completion once it has suspended
+ * for the last time, after which its frame can be destroyed from any thread */
+class signal_task {
+public:
+    struct promise_type : promise_allocation {
+        struct final_awaiter {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                promise_type& promise = handle.promise();
+                // copy the parent out first, the frame may be gone after the add
+                std::coroutine_handle<> const parent = promise.parent;
+                if (completion_add(promise.completion, -1) == 0 && parent) {
+                    return parent;
+                }
+                return std::noop_coroutine();
+            }
+            void await_resume() const noexcept {}
+        };
+
+        signal_task get_return_object() noexcept
+        {
+            return signal_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        final_awaiter final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+
+        TaskCompletion*         completion = nullptr;
+        std::coroutine_handle<> parent;
+    };
+
+    signal_task() = default;
+    explicit signal_task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+    signal_task(signal_task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    signal_task& operator=(signal_task&& other) noexcept
+    {
+        std::swap(this->_handle, other._handle);
+        return *this;
+    }
+    ~signal_task()
+    {
+        if (this->_handle) {
+            this->_handle.destroy();
+        }
+    }
+
+    /// @brief Runs the coroutine on a pool thread. completion must have been
+    ///     incremented for it; parent is resumed by whoever brings it to zero
+    void start(TaskPool* pool, TaskCompletion* completion, std::coroutine_handle<> parent)
+    {
+        this->_handle.promise().completion = completion;
+        this->_handle.promise().parent = parent;
+        tpSpawnTask(pool, &signal_task::_Resume, this->_handle.address(), nullptr);
+    }
+
+private:
+    static void _Resume(int, void* data)
+    {
+        std::coroutine_handle<>::from_address(data).resume();
+    }
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+} // namespace detail
+
+/// @brief A lazily started coroutine producing a T
+template<typename T>
+class task {
+public:
+    using promise_type = detail::task_promise<T>;
+
+    task() = default;
+    explicit task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+    task(task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    task& operator=(task&& other) noexcept
+    {
+        std::swap(this->_handle, other._handle);
+        return *this;
+    }
+    task(task const&) = delete;
+    task& operator=(task const&) = delete;
+    ~task()
+    {
+        if (this->_handle) {
+            this->_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return !this->_handle || this->_handle.done();
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        this->_handle.promise().continuation = awaiter;
+        return this->_handle;
+    }
+    T await_resume()
+    {
+        if constexpr (!std::is_void<T>::value) {
+            return std::move(*this->_handle.promise().result);
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+};
+
+template<typename T>
+task<T> detail::task_promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+inline task<void> detail::task_promise<void>::get_return_object() noexcept
+{
+    return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/// @brief Awaiting the result suspends the coroutine and resumes it from a
+///     task on one of the pool's threads
+class schedule_awaitable {
+public:
+    explicit schedule_awaitable(TaskPool* pool) : _pool(pool) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) const
+    {
+        tpSpawnTask(this->_pool, &schedule_awaitable::_Resume, handle.address(), nullptr);
+    }
+    void await_resume() const noexcept {}
+
+private:
+    static void _Resume(int, void* data)
+    {
+        std::coroutine_handle<>::from_address(data).resume();
+    }
+
+    TaskPool* _pool;
+};
+
+inline schedule_awaitable schedule(TaskPool* pool)
+{
+    return schedule_awaitable(pool);
+}
+
+namespace detail {
+
+template<typename T>
+signal_task run_and_store(task<T> task, std::optional<T>* result)
+{
+    result->emplace(co_await std::move(task));
+}
+inline signal_task run_and_store(task<void> task, std::optional<bool>* result)
+{
+    co_await std::move(task);
+    result->emplace(true);
+}
+
+/* starts every child on the pool and suspends until the last one finishes.
+ * The completion holds one extra count for the awaiter itself so that
+ * whichever of them reaches zero last resumes the awaiter */
+class when_all_awaitable {
+public:
+    when_all_awaitable(TaskPool* pool, std::vector<signal_task>& children)
+        : _pool(pool)
+        , _children(children)
+        , _completion((int)children.size() + 1)
+    {
+    }
+
+    bool await_ready() const noexcept { return this->_children.empty(); }
+    bool await_suspend(std::coroutine_handle<> awaiter)
+    {
+        for (signal_task& child : this->_children) {
+            child.start(this->_pool, &this->_completion, awaiter);
+        }
+        return completion_add(&this->_completion, -1) != 0;
+    }
+    void await_resume() const noexcept {}
+
+private:
+    TaskPool*                   _pool;
+    std::vector<signal_task>&   _children;
+    TaskCompletion              _completion;
+};
+
+} // namespace detail
+
+/// @brief Runs all tasks concurrently on the pool and returns their results in
+///     the same order once every one of them has finished
+template<typename T>
+task<std::vector<T>> when_all(TaskPool* pool, std::vector<task<T>> tasks)
+{
+    std::vector<std::optional<T>> results(tasks.size());
+    std::vector<detail::signal_task> children;
+    children.reserve(tasks.size());
+    for (size_t ii = 0; ii < tasks.size(); ++ii) {
+        children.push_back(detail::run_and_store(std::move(tasks[ii]), &results[ii]));
+    }
+    co_await detail::when_all_awaitable(pool, children);
+
+    std::vector<T> values;
+    values.reserve(results.size());
+    for (std::optional<T>& result : results) {
+        values.push_back(std::move(*result));
+    }
+    co_return values;
+}
+
+inline task<void> when_all(TaskPool* pool, std::vector<task<void>> tasks)
+{
+    std::vector<std::optional<bool>> results(tasks.size());
+    std::vector<detail::signal_task> children;
+    children.reserve(tasks.size());
+    for (size_t ii = 0; ii < tasks.size(); ++ii) {
+        children.push_back(detail::run_and_store(std::move(tasks[ii]), &results[ii]));
+    }
+    co_await detail::when_all_awaitable(pool, children);
+}
+
+/// @brief Blocks until the task has finished and returns its result. Like
+///     tpWaitForCompletion, the calling thread helps process tasks meanwhile
+template<typename T>
+T sync_wait(TaskPool* pool, task<T> task)
+{
+    TaskCompletion completion = 1;
+    if constexpr (std::is_void<T>::value) {
+        std::optional<bool> result;
+        detail::signal_task child = detail::run_and_store(std::move(task), &result);
+        child.start(pool, &completion, nullptr);
+        tpWaitForCompletion(pool, &completion);
+    } else {
+        std::optional<T> result;
+        detail::signal_task child = detail::run_and_store(std::move(task), &result);
+        child.start(pool, &completion, nullptr);
+        tpWaitForCompletion(pool, &completion);
+        return std::move(*result);
+    }
+}
+
+} // namespace tp
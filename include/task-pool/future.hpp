@@ -0,0 +1,452 @@
+#pragma once
+#include <assert.h>
+#include <stdint.h>
+#include <atomic>
+#include <exception>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "task-pool/task-pool.h"
+
+/* Futures and promises over the task pool.
+ *
+ *  tp::Future<int> answer = tp::async(pool, []() { return 42; });
+ *  tp::Future<int> doubled = std::move(answer).then([](int value) {
+ *      return value * 2;
+ *  });
+ *  int const result = doubled.get(); // helps run pool tasks while waiting
+ *
+ * A future's value lives inline in its shared state, which is allocated with
+ * the pool's AllocationCallbacks together with the function that produces
+ * it, and running out of memory terminates. Fulfilling a future is a single
+ * atomic exchange, which also hands over the continuation registered by
+ * then(), if any, so an async call costs an allocation, a spawn and that
+ * exchange. Continuations run as pool tasks. A future that is destroyed
+ * before its value is ready waits for it, so the producer never writes into
+ * freed memory. Futures of void are not supported; use tpSpawnTask with a
+ * TaskCompletion for those.
+ */
+namespace tp {
+
+template<typename T> class Future;
+template<typename T> class Promise;
+
+namespace detail {
+
+struct Continuation {
+    void (*run)(Continuation* continuation);
+};
+
+inline Continuation* fulfilled_marker()
+{
+    return reinterpret_cast<Continuation*>(uintptr_t(1));
+}
+
+inline void run_continuation(int, void* data)
+{
+    Continuation* const continuation = (Continuation*)data;
+    continuation->run(continuation);
+}
+
+inline void schedule(TaskPool* pool, Continuation* continuation)
+{
+    tpSpawnTask(pool, &run_continuation, continuation, nullptr);
+}
+
+inline void* allocate(TaskPool* pool, size_t size)
+{
+    AllocationCallbacks const* allocator = tpGetAllocator(pool);
+    void* const memory = allocator->allocate_function(size, allocator->user_data);
+    if (memory == nullptr) {
+        std::terminate();
+    }
+    return memory;
+}
+
+template<typename T, typename... Args>
+T* create(TaskPool* pool, Args&&... args)
+{
+    return new (allocate(pool, sizeof(T))) T(std::forward<Args>(args)...);
+}
+
+template<typename T>
+void destroy(TaskPool* pool, T* object)
+{
+    AllocationCallbacks const* allocator = tpGetAllocator(pool);
+    object->~T();
+    allocator->free_function(object, allocator->user_data);
+}
+
+/* states that carry more than the value, like the function producing it,
+ * set destroy_function to free all of it */
+template<typename T>
+struct FutureState {
+    explicit FutureState(TaskPool* pool_)
+        : pool(pool_)
+        , continuation(nullptr)
+        , destroy_function(&FutureState::Destroy)
+    {
+    }
+    ~FutureState()
+    {
+        if (this->is_ready()) {
+            this->value().~T();
+        }
+    }
+
+    T& value()
+    {
+        return *reinterpret_cast<T*>(&this->storage);
+    }
+    bool is_ready() const
+    {
+        return this->continuation.load(std::memory_order_acquire) == fulfilled_marker();
+    }
+
+    template<typename U>
+    void set_value(U&& value)
+    {
+        new (&this->storage) T(std::forward<U>(value));
+        Continuation* const next = this->continuation.exchange(fulfilled_marker(),
+                                                                std::memory_order_acq_rel);
+        if (next) {
+            schedule(this->pool, next);
+        }
+    }
+
+    /* runs next once the value is set, right away if it already is */
+    void attach(Continuation* next)
+    {
+        Continuation* expected = nullptr;
+        if (!this->continuation.compare_exchange_strong(expected, next,
+                                                        std::memory_order_acq_rel)) {
+            schedule(this->pool, next);
+        }
+    }
+
+    void wait() const
+    {
+        while (!this->is_ready()) {
+            if (tpRunPendingTask(this->pool) == 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    static void Destroy(FutureState* state)
+    {
+        destroy(state->pool, state);
+    }
+
+    TaskPool*                       pool;
+    std::atomic<Continuation*>      continuation;
+    void                            (*destroy_function)(FutureState* state);
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+};
+
+template<typename T>
+void destroy_state(FutureState<T>* state)
+{
+    state->destroy_function(state);
+}
+
+/* the state of an async call, which is also the task computing the value */
+template<typename T, typename F>
+struct AsyncState : FutureState<T>, Continuation {
+    AsyncState(TaskPool* pool_, F&& function_)
+        : FutureState<T>(pool_)
+        , function(std::move(function_))
+    {
+        this->destroy_function = &AsyncState::Destroy;
+        this->run = &AsyncState::Run;
+    }
+
+    static void Run(Continuation* continuation)
+    {
+        AsyncState* const self = static_cast<AsyncState*>(continuation);
+        self->set_value(self->function());
+    }
+    static void Destroy(FutureState<T>* state)
+    {
+        destroy(state->pool, static_cast<AsyncState*>(state));
+    }
+
+    F   function;
+};
+
+/* the state of a then() call, which is also the continuation of its input */
+template<typename T, typename U, typename F>
+struct ThenState : FutureState<U>, Continuation {
+    ThenState(TaskPool* pool_, FutureState<T>* input_, F&& function_)
+        : FutureState<U>(pool_)
+        , input(input_)
+        , function(std::move(function_))
+    {
+        this->destroy_function = &ThenState::Destroy;
+        this->run = &ThenState::Run;
+    }
+
+    static void Run(Continuation* continuation)
+    {
+        ThenState* const self = static_cast<ThenState*>(continuation);
+        U value = self->function(std::move(self->input->value()));
+        destroy_state(self->input);
+        self->set_value(std::move(value));
+    }
+    static void Destroy(FutureState<U>* state)
+    {
+        destroy(state->pool, static_cast<ThenState*>(state));
+    }
+
+    FutureState<T>* input;
+    F               function;
+};
+
+/* shared by the inputs of when_all and when_any, allocated in one piece with
+ * an element and an input pointer per input after it. on_ready runs for each
+ * input as it becomes ready, on_last once all of them are, after which the
+ * inputs are freed */
+template<typename T, typename Result>
+struct Combinator {
+    struct Element : Continuation {
+        Combinator* combinator;
+        size_t      index;
+    };
+
+    typedef void (ReadyFunction)(Combinator* combinator, size_t index);
+    typedef void (LastFunction)(Combinator* combinator);
+
+    /* takes the states of the futures, which are left invalid */
+    static Combinator* create(TaskPool* pool, std::vector<Future<T>>& futures,
+                              FutureState<Result>* output, ReadyFunction* on_ready,
+                              LastFunction* on_last)
+    {
+        size_t const count = futures.size();
+        size_t const size = sizeof(Combinator) + (sizeof(Element) + sizeof(FutureState<T>*)) * count;
+        Combinator* const self = new (allocate(pool, size)) Combinator(pool, count, output,
+                                                                       on_ready, on_last);
+        for (size_t ii = 0; ii < count; ++ii) {
+            Element* const element = new (&self->elements[ii]) Element;
+            element->run = &Combinator::Run;
+            element->combinator = self;
+            element->index = ii;
+            self->inputs[ii] = futures[ii].release();
+        }
+        return self;
+    }
+
+    void attach()
+    {
+        // the combinator may be gone as soon as the last input is attached
+        size_t const count = this->num_inputs;
+        for (size_t ii = 0; ii < count; ++ii) {
+            this->inputs[ii]->attach(&this->elements[ii]);
+        }
+    }
+
+    static void Run(Continuation* continuation)
+    {
+        Element* const element = (Element*)continuation;
+        Combinator* const self = element->combinator;
+        if (self->on_ready) {
+            self->on_ready(self, element->index);
+        }
+        if (self->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (self->on_last) {
+                self->on_last(self);
+            }
+            for (size_t ii = 0; ii < self->num_inputs; ++ii) {
+                destroy_state(self->inputs[ii]);
+            }
+            destroy(self->pool, self);
+        }
+    }
+
+    TaskPool*               pool;
+    FutureState<Result>*    output;
+    size_t                  num_inputs;
+    Element*                elements;
+    FutureState<T>**        inputs;
+    std::atomic<size_t>     remaining;
+    ReadyFunction*          on_ready;
+    LastFunction*           on_last;
+    std::atomic<bool>       done;
+
+private:
+    Combinator(TaskPool* pool_, size_t num_inputs_, FutureState<Result>* output_,
+               ReadyFunction* on_ready_, LastFunction* on_last_)
+        : pool(pool_)
+        , output(output_)
+        , num_inputs(num_inputs_)
+        , elements((Element*)(this + 1))
+        , inputs((FutureState<T>**)(this->elements + num_inputs_))
+        , remaining(num_inputs_)
+        , on_ready(on_ready_)
+        , on_last(on_last_)
+        , done(false)
+    {
+    }
+};
+
+} // namespace detail
+
+/// @brief The consumer end of an asynchronously produced value
+template<typename T>
+class Future {
+public:
+    Future() : _state(nullptr) {}
+    explicit Future(detail::FutureState<T>* state) : _state(state) {}
+    Future(Future&& other) : _state(other.release()) {}
+    Future& operator=(Future&& other)
+    {
+        std::swap(this->_state, other._state);
+        return *this;
+    }
+    Future(Future const&) = delete;
+    Future& operator=(Future const&) = delete;
+    ~Future()
+    {
+        if (this->_state) {
+            this->_state->wait();
+            detail::destroy_state(this->_state);
+        }
+    }
+
+    bool valid() const { return this->_state != nullptr; }
+    bool is_ready() const { return this->_state->is_ready(); }
+
+    /// @brief Waits until the value is ready. The calling thread helps run
+    ///     pool tasks meanwhile
+    void wait() const { this->_state->wait(); }
+
+    /// @brief Waits for the value and moves it out, leaving the future invalid
+    T get()
+    {
+        this->_state->wait();
+        T value(std::move(this->_state->value()));
+        detail::destroy_state(this->release());
+        return value;
+    }
+
+    /// @brief Schedules function(value) as a pool task once the value is ready
+    ///     and returns a future for its result. The future is consumed
+    template<typename F>
+    Future<decltype(std::declval<F&>()(std::declval<T>()))> then(F function) &&
+    {
+        typedef decltype(std::declval<F&>()(std::declval<T>())) U;
+        TaskPool* const pool = this->_state->pool;
+        detail::FutureState<T>* const input = this->release();
+        auto* const output = detail::create<detail::ThenState<T, U, F>>(pool, pool, input,
+                                                                        std::move(function));
+        input->attach(output);
+        return Future<U>(output);
+    }
+
+    /// @brief Gives up ownership of the shared state, for the combinators
+    detail::FutureState<T>* release()
+    {
+        detail::FutureState<T>* const state = this->_state;
+        this->_state = nullptr;
+        return state;
+    }
+
+private:
+    detail::FutureState<T>* _state;
+};
+
+/// @brief The producer end of a future, for values set by hand. It must be
+///     fulfilled exactly once if its future was retrieved
+template<typename T>
+class Promise {
+public:
+    explicit Promise(TaskPool* pool)
+        : _state(detail::create<detail::FutureState<T>>(pool, pool))
+        , _retrieved(false)
+    {
+    }
+    Promise(Promise const&) = delete;
+    Promise& operator=(Promise const&) = delete;
+    ~Promise()
+    {
+        if (!this->_retrieved) {
+            detail::destroy_state(this->_state);
+        }
+    }
+
+    Future<T> get_future()
+    {
+        this->_retrieved = true;
+        return Future<T>(this->_state);
+    }
+
+    template<typename U>
+    void set_value(U&& value)
+    {
+        this->_state->set_value(std::forward<U>(value));
+    }
+
+private:
+    detail::FutureState<T>* _state;
+    bool                    _retrieved;
+};
+
+/// @brief Runs function() as a pool task and returns a future for its result
+template<typename F>
+Future<decltype(std::declval<F&>()())> async(TaskPool* pool, F function)
+{
+    typedef decltype(std::declval<F&>()()) T;
+    auto* const output = detail::create<detail::AsyncState<T, F>>(pool, pool, std::move(function));
+    detail::schedule(pool, output);
+    return Future<T>(output);
+}
+
+/// @brief Returns a future for all of the values, in the order of the inputs
+template<typename T>
+Future<std::vector<T>> when_all(TaskPool* pool, std::vector<Future<T>> futures)
+{
+    typedef detail::Combinator<T, std::vector<T>> Combinator;
+    detail::FutureState<std::vector<T>>* const output =
+        detail::create<detail::FutureState<std::vector<T>>>(pool, pool);
+    if (futures.empty()) {
+        output->set_value(std::vector<T>());
+        return Future<std::vector<T>>(output);
+    }
+
+    auto const on_last = [](Combinator* combinator) {
+        std::vector<T> values;
+        values.reserve(combinator->num_inputs);
+        for (size_t ii = 0; ii < combinator->num_inputs; ++ii) {
+            values.push_back(std::move(combinator->inputs[ii]->value()));
+        }
+        combinator->output->set_value(std::move(values));
+    };
+    Combinator* const combinator = Combinator::create(pool, futures, output, nullptr, +on_last);
+    combinator->attach();
+    return Future<std::vector<T>>(output);
+}
+
+/// @brief Returns a future for the index and value of the first input to
+///     become ready. The others are still run to completion
+template<typename T>
+Future<std::pair<size_t, T>> when_any(TaskPool* pool, std::vector<Future<T>> futures)
+{
+    typedef std::pair<size_t, T> Result;
+    typedef detail::Combinator<T, Result> Combinator;
+    assert(!futures.empty());
+    detail::FutureState<Result>* const output = detail::create<detail::FutureState<Result>>(pool, pool);
+
+    auto const on_ready = [](Combinator* combinator, size_t index) {
+        if (combinator->done.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        T& value = combinator->inputs[index]->value();
+        combinator->output->set_value(Result(index, std::move(value)));
+    };
+    Combinator* const combinator = Combinator::create(pool, futures, output, +on_ready, nullptr);
+    combinator->attach();
+    return Future<Result>(output);
+}
+
+} // namespace tp
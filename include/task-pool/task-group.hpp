@@ -0,0 +1,163 @@
+#pragma once
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "task-pool/task-pool.h"
+
+/* Structured task groups over the task pool.
+ *
+ *  tp::TaskGroup outer(pool);
+ *  outer.spawn([&]() {
+ *      tp::TaskGroup inner(outer); // nested in outer
+ *      inner.spawn([]() { ... });
+ *  }); // inner joins here
+ *  outer.cancel(); // skips the tasks of outer and inner that haven't started
+ *
+ * A group joins when it goes out of scope, so the tasks it spawned can't
+ * outlive the data they captured by reference. Closures are allocated with
+ * the pool's AllocationCallbacks and freed once they ran or were skipped.
+ * Like the coroutines, running out of memory terminates.
+ */
+namespace tp {
+
+namespace detail {
+
+struct GroupClosureBase {
+    void (*destroy)(GroupClosureBase* closure);
+    TaskPool* pool;
+};
+
+/* runs in place of skipped tasks, which would otherwise leak their closure */
+inline void skip_group_closure(int, void* data)
+{
+    GroupClosureBase* const closure = (GroupClosureBase*)data;
+    closure->destroy(closure);
+}
+
+inline ::TaskGroup* create_group(TaskPool* pool, ::TaskGroup* parent)
+{
+    ::TaskGroup* const group = tpCreateTaskGroup(pool, parent);
+    if (group == nullptr) {
+        std::terminate();
+    }
+    tpSetTaskGroupSkipFunction(group, &skip_group_closure);
+    return group;
+}
+
+template<typename F>
+struct GroupClosure : GroupClosureBase {
+    template<typename U>
+    GroupClosure(TaskPool* pool_, U&& function_)
+        : function(std::forward<U>(function_))
+    {
+        this->destroy = &GroupClosure::Destroy;
+        this->pool = pool_;
+    }
+
+    static void Run(int, void* data)
+    {
+        GroupClosure* const self = (GroupClosure*)data;
+        self->function();
+        Destroy(self);
+    }
+    static void Destroy(GroupClosureBase* closure)
+    {
+        GroupClosure* const self = (GroupClosure*)closure;
+        AllocationCallbacks const* allocator = tpGetAllocator(self->pool);
+        self->~GroupClosure();
+        allocator->free_function(self, allocator->user_data);
+    }
+
+    F function;
+};
+
+} // namespace detail
+
+/// @brief Owns a ::TaskGroup and joins it on destruction
+class TaskGroup {
+public:
+    explicit TaskGroup(TaskPool* pool)
+        : _pool(pool)
+        , _group(detail::create_group(pool, nullptr))
+    {
+    }
+    /// @brief Creates a group nested in parent
+    explicit TaskGroup(TaskGroup& parent)
+        : _pool(parent._pool)
+        , _group(detail::create_group(parent._pool, parent._group))
+    {
+    }
+    ~TaskGroup()
+    {
+        tpDestroyTaskGroup(this->_group);
+    }
+
+    TaskGroup(TaskGroup const&) = delete;
+    TaskGroup& operator=(TaskGroup const&) = delete;
+
+    /// @brief Runs function() as a task of the group, unless the group is
+    ///     cancelled first. The closure is destroyed either way
+    template<typename F>
+    void spawn(F&& function)
+    {
+        typedef detail::GroupClosure<typename std::decay<F>::type> Closure;
+        Closure* const closure = this->create<Closure>(std::forward<F>(function));
+        tpSpawnGroupTask(this->_group, &Closure::Run, closure);
+    }
+
+    /// @brief Runs one of child and continuation right here and spawns the
+    ///     other into the group, like tpForkGroupTask with the pool's
+    ///     SpawnPolicy. Both count in the group and neither runs if the group
+    ///     is cancelled before it starts
+    template<typename F, typename C>
+    void fork(F&& child, C&& continuation)
+    {
+        this->fork(tpGetSpawnPolicy(this->_pool), std::forward<F>(child),
+                   std::forward<C>(continuation));
+    }
+    /// @brief Forks with the given SpawnPolicy instead of the pool's
+    template<typename F, typename C>
+    void fork(int policy, F&& child, C&& continuation)
+    {
+        typedef detail::GroupClosure<typename std::decay<F>::type> ChildClosure;
+        typedef detail::GroupClosure<typename std::decay<C>::type> ContinuationClosure;
+        ChildClosure* const child_closure = this->create<ChildClosure>(std::forward<F>(child));
+        ContinuationClosure* const continuation_closure =
+            this->create<ContinuationClosure>(std::forward<C>(continuation));
+        tpForkGroupTask(this->_group, &ChildClosure::Run, child_closure,
+                        &ContinuationClosure::Run, continuation_closure, policy);
+    }
+
+    /// @brief Waits for the group's tasks and its nested groups, helping with
+    ///     the group's own tasks first
+    void wait() { tpWaitForTaskGroup(this->_group); }
+    void cancel() { tpCancelTaskGroup(this->_group); }
+    bool is_cancelled() const { return tpIsTaskGroupCancelled(this->_group) != 0; }
+    TaskGroupStats stats() const
+    {
+        TaskGroupStats stats;
+        tpGetTaskGroupStats(this->_group, &stats);
+        return stats;
+    }
+
+    TaskPool* pool() const { return this->_pool; }
+    ::TaskGroup* get() const { return this->_group; }
+
+private:
+    template<typename Closure, typename F>
+    Closure* create(F&& function)
+    {
+        AllocationCallbacks const* allocator = tpGetAllocator(this->_pool);
+        void* const memory = allocator->allocate_function(sizeof(Closure), allocator->user_data);
+        if (memory == nullptr) {
+            std::terminate();
+        }
+        return new (memory) Closure(this->_pool, std::forward<F>(function));
+    }
+
+    TaskPool*       _pool;
+    ::TaskGroup*    _group;
+};
+
+} // namespace tp
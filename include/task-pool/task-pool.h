@@ -1,4 +1,6 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,31 +15,337 @@ typedef struct AllocationCallbacks {
 typedef struct TaskPool TaskPool;
 typedef struct Task Task;
 typedef volatile int TaskCompletion;
+typedef volatile int TaskCancellation;
+typedef struct ShardedCompletion ShardedCompletion;
+typedef struct TaskGroup TaskGroup;
 
 typedef void (TaskFunction)(int thread_id, void* data);
+/// @param result The number of bytes transferred, or a negative errno
+typedef void (AsyncIoFunction)(int thread_id, void* data, int64_t result);
+/// @param events The WatchEvents that fired
+typedef void (WatchFunction)(int thread_id, void* data, int events);
+
+typedef enum WatchEvents {
+    kWatchRead = 0x1,   ///< The fd is readable, or the peer hung up
+    kWatchWrite = 0x2,  ///< The fd is writable
+    kWatchError = 0x4,  ///< An error occurred; reported whether asked for or not
+} WatchEvents;
+
+/// @brief What a spawn does when there's no room for its task
+typedef enum AdmissionPolicy {
+    kAdmitBlock = 0,    ///< Wait for room, running other tasks meanwhile (default)
+    kAdmitInline = 1,   ///< Run the task right away on the spawning thread
+    kAdmitSpill = 2,    ///< Queue the task on a list shared by the pool
+} AdmissionPolicy;
+
+/// @brief Which half of a fork, see tpForkTask, is queued for stealing
+typedef enum SpawnPolicy {
+    kSpawnHelpFirst = 0,    ///< Queue the child, run the continuation (default)
+    kSpawnWorkFirst = 1,    ///< Run the child, queue the continuation
+} SpawnPolicy;
+
+/// @brief The order in which an idle thread tries to steal from the others
+typedef enum VictimPolicy {
+    kVictimRoundRobin = 0,  ///< The threads after the thief, in order (default)
+    kVictimRandom = 1,      ///< The others in order, starting at a random one
+} VictimPolicy;
+
+/// @brief What a worker does when it finds no work
+typedef enum IdlePolicy {
+    kIdleSleep = 0,         ///< Sleep right away (default)
+    kIdleSpin = 1,          ///< Yield and look again a few times first
+} IdlePolicy;
+
+/// @brief Which sleeping workers a spawn wakes
+typedef enum WakePolicy {
+    kWakeAll = 0,           ///< All of them (default)
+    kWakeOne = 1,           ///< One of them
+} WakePolicy;
+
+/// @brief Caller-defined scheduling decisions. Each function that isn't NULL
+///     replaces the policy it stands for
+typedef struct SchedulerCallbacks {
+    /// Returns the slot that thread_id steals from on its attempt-th try, or
+    /// thread_id to skip the try
+    int (*select_victim)(void* user_data, int thread_id, int num_slots, int attempt);
+    /// Returns non-zero for an idle worker to look for work again, zero to sleep
+    int (*keep_spinning)(void* user_data, int thread_id, int idle_rounds);
+    void* user_data;
+} SchedulerCallbacks;
+
+/// @brief Counts for a task group and every group nested in it, including
+///     nested groups that were already destroyed
+typedef struct TaskGroupStats {
+    uint64_t num_spawned;   ///< Tasks spawned into the groups
+    uint64_t num_finished;  ///< Tasks that ran or were skipped
+    uint64_t num_skipped;   ///< Tasks skipped because their group was cancelled
+    int num_groups;         ///< The group and its nested groups still alive
+} TaskGroupStats;
+
+typedef struct TaskPoolCreateInfo {
+    /// The number of additional threads to spawn, see tpCreatePool
+    int num_threads;
+    /// The number of reserve threads that stand in for blocked threads, see
+    /// tpBeginBlocking
+    int num_spare_threads;
+    /// The number of task queues reserved for threads the pool didn't create,
+    /// see tpRegisterThread
+    int max_external_threads;
+    /// The allocator for the pool, or NULL to use malloc and free
+    AllocationCallbacks const* allocator;
+    /// Non-zero to serve tpReadAsync from a blocking helper thread
+    int disable_io_uring;
+    /// Non-zero to pick the next task and the worker that runs it with a
+    /// generator seeded with seed, so runs with the same seed repeat
+    int deterministic;
+    /// The seed for deterministic mode
+    uint64_t seed;
+    /// Non-zero to make stealing pay for the fence of popping one's own
+    /// queue, see tpUsesAsymmetricFences
+    int asymmetric_fences;
+    /// Experimental: non-zero to give every CPU a task queue shared by the
+    /// threads running on it, see tpNumCpuQueues
+    int per_cpu_queues;
+    /// The AdmissionPolicy of spawns that find no room for their task
+    int admission_policy;
+    /// The most tasks that may be spawned and not finished before spawns go
+    /// through admission_policy, or 0 for no limit
+    int max_tasks_in_flight;
+    /// The SpawnPolicy tpForkTask uses
+    int spawn_policy;
+    /// The VictimPolicy, IdlePolicy and WakePolicy of the scheduler
+    int victim_policy;
+    int idle_policy;
+    int wake_policy;
+    /// Callbacks that replace victim_policy or idle_policy, or NULL
+    SchedulerCallbacks const* scheduler_callbacks;
+} TaskPoolCreateInfo;
 
 /// @param [in] num_threads The number of additional threads to spawn. Set this
 ///     to the total number of hardware threads your machine has - 1 for the main
 ///     thread
 TaskPool* tpCreatePool(int num_threads, AllocationCallbacks const* allocator);
+TaskPool* tpCreatePoolWithInfo(TaskPoolCreateInfo const* info);
 void tpDestroyPool(TaskPool* pool);
 
 int tpNumThreads(TaskPool const* pool);
+/// @brief Returns the allocator the pool was created with, or the default one
+AllocationCallbacks const* tpGetAllocator(TaskPool const* pool);
 int tpNumIdleThreads(TaskPool const* pool);
+int tpNumSpareThreads(TaskPool const* pool);
+/// @brief Returns the number of per-CPU queues, 0 unless the pool was created
+///     with per_cpu_queues
+int tpNumCpuQueues(TaskPool const* pool);
+/// @brief Returns non-zero if the pool was created with asymmetric_fences and
+///     the system supports them
+int tpUsesAsymmetricFences(TaskPool const* pool);
+
+/// @brief Marks the calling thread as blocked until the matching
+///     tpEndBlocking, letting a spare thread run tasks in its place
+void tpBeginBlocking(TaskPool* pool);
+/// @brief Ends a blocking region started with tpBeginBlocking
+void tpEndBlocking(TaskPool* pool);
+
+/// @brief Sets how many of the pool's worker threads may run tasks. The
+///     others park once their own queue is empty
+/// @param [in] num_workers Clamped to [0, tpNumThreads(pool) - 1]
+void tpSetActiveWorkers(TaskPool* pool, int num_workers);
+int tpNumActiveWorkers(TaskPool const* pool);
+
+typedef struct AutoScaleInfo {
+    int min_workers;            ///< Never park below this many workers
+    int max_workers;            ///< Never activate more than this many workers
+    int idle_timeout_ms;        ///< How long a worker idles before it parks
+    int queue_depth_threshold;  ///< Queue depth at spawn that activates a worker
+} AutoScaleInfo;
+
+/// @brief Lets the pool park idle workers and reactivate them when queues grow
+/// @param [in] info The auto-scale settings, or NULL to disable auto-scaling
+void tpSetAutoScale(TaskPool* pool, AutoScaleInfo const* info);
+
+typedef struct InlineSpawnInfo {
+    int queue_depth_threshold;  ///< Queue depth at spawn from which tasks run inline
+    int max_inline_depth;       ///< Inline tasks that may nest on one thread's stack
+} InlineSpawnInfo;
+
+/// @brief Lets spawns run their task right away once the spawning thread's
+///     queue is deep enough and no worker is idle
+/// @param [in] info The inline settings, or NULL to always queue (default)
+void tpSetInlineSpawn(TaskPool* pool, InlineSpawnInfo const* info);
+
+/// @brief Gives the calling thread, which the pool didn't create, its own task
+///     queue in the pool
+/// @return The calling thread's id in the pool, or -1 if the thread already
+///     has one or all of the pool's max_external_threads slots are taken
+int tpRegisterThread(TaskPool* pool);
+/// @brief Releases the calling thread's slot once every task it spawned has
+///     finished, helping process tasks meanwhile
+void tpUnregisterThread(TaskPool* pool);
 
 /// @param [in] function The function to call asynchronously
 /// @param [in] data The data to pass to the function
 /// @param [in,out] completion An integer that will be incremented by one when
 ///     the task starts and decremented upon completion of the task. This can be
-///     used to tie tasks together by giving multiple tasks the same completion
+///     used to tie tasks together by giving multiple tasks the same completion.
+///     May be NULL for tasks nobody waits on
+/// @note Threads that don't belong to the pool submit through tpInjectTask
 void tpSpawnTask(TaskPool* pool, TaskFunction* function, void* data,
                  TaskCompletion* completion);
 
+/// @brief Spawns a task like tpSpawnTask, unless there's no room for it
+/// @return 0 if the task was spawned, or -1 with the completion left alone
+int tpTrySpawnTask(TaskPool* pool, TaskFunction* function, void* data,
+                   TaskCompletion* completion);
+
+/// @brief Spawns child and continuation, the rest of the caller, counted in
+///     completion. The spawn_policy picks which one is queued; the caller
+///     runs the other before returning
+/// @param [in,out] completion See tpSpawnTask
+void tpForkTask(TaskPool* pool, TaskFunction* child, void* child_data,
+                TaskFunction* continuation, void* continuation_data,
+                TaskCompletion* completion);
+/// @brief Forks like tpForkTask with the given SpawnPolicy instead of the
+///     pool's
+void tpForkTaskWithPolicy(TaskPool* pool, TaskFunction* child, void* child_data,
+                          TaskFunction* continuation, void* continuation_data,
+                          TaskCompletion* completion, int policy);
+/// @brief Returns the pool's SpawnPolicy for tpForkTask
+int tpGetSpawnPolicy(TaskPool const* pool);
+
+/// @brief Spawns a task that is skipped, still decrementing its completion,
+///     if cancellation is set before it starts
+/// @param [in] cancellation The cancellation the task observes
+void tpSpawnCancellableTask(TaskPool* pool, TaskFunction* function, void* data,
+                            TaskCompletion* completion,
+                            TaskCancellation const* cancellation);
+
+/// @brief Cancels every task spawned with this cancellation
+void tpCancel(TaskCancellation* cancellation);
+
+/// @brief Returns non-zero if the task running on the calling thread was
+///     cancelled. Long-running tasks can poll this to stop early
+int tpIsCancelled(void);
+
+/// @brief Submits a task from any thread, including threads that the pool
+///     didn't create and that aren't registered
+/// @param [in] function The function to call asynchronously
+/// @param [in] data The data to pass to the function
+/// @param [in,out] completion See tpSpawnTask
+void tpInjectTask(TaskPool* pool, TaskFunction* function, void* data,
+                  TaskCompletion* completion);
+
+/// @brief Returns the monotonic time that timed tasks are scheduled against,
+///     in microseconds
+uint64_t tpGetTime(void);
+
+/// @brief Spawns a task once tpGetTime reaches time_us, never early. Any
+///     thread may call this
+/// @param [in] time_us The time to spawn the task at, see tpGetTime
+/// @param [in,out] completion See tpSpawnTask. It covers the delay too
+void tpSpawnTaskAt(TaskPool* pool, uint64_t time_us, TaskFunction* function,
+                   void* data, TaskCompletion* completion);
+/// @brief Spawns a task after delay_us microseconds, see tpSpawnTaskAt
+void tpSpawnTaskAfterDelay(TaskPool* pool, uint64_t delay_us,
+                           TaskFunction* function, void* data,
+                           TaskCompletion* completion);
+
+/// @brief Spawns a cancellable task every period_us microseconds, starting
+///     one period from now, until cancellation is set
+/// @param [in] period_us The time between two runs, at least one millisecond
+/// @param [in,out] completion Counts the runs and the timer itself
+/// @param [in] cancellation Stops the periodic task, required
+void tpSpawnPeriodicTask(TaskPool* pool, uint64_t period_us,
+                         TaskFunction* function, void* data,
+                         TaskCompletion* completion,
+                         TaskCancellation const* cancellation);
+
+/// @brief Reads from a file without blocking a pool thread, then spawns
+///     function with the result. Like pread, it may read fewer bytes
+/// @param [in] fd The file to read from, open until the function is called
+/// @param [out] buffer Receives the data, valid until the function is called
+/// @param [in] offset The file offset to read at
+/// @param [in] function Called on a pool thread once the read has finished
+/// @param [in,out] completion See tpSpawnTask
+void tpReadAsync(TaskPool* pool, int fd, void* buffer, size_t size,
+                 uint64_t offset, AsyncIoFunction* function, void* data,
+                 TaskCompletion* completion);
+
+/// @brief Spawns function once fd becomes ready for any of events. Watches
+///     are one-shot and replace earlier watches on the fd. Linux only.
+/// @param [in] events A combination of kWatchRead and kWatchWrite
+/// @return 0, or a negative errno if the fd can't be watched
+int tpWatchFd(TaskPool* pool, int fd, int events, WatchFunction* function,
+              void* data);
+/// @brief Drops the watch on fd, if there is one. Call this before closing a
+///     watched fd. A function that is already spawned still runs
+void tpUnwatchFd(TaskPool* pool, int fd);
+
+/// @brief Binds a completion to an eventfd that becomes readable when the
+///     completion drops to zero, until acknowledged. Linux only.
+/// @return The eventfd, which belongs to the pool, or a negative errno
+int tpCreateCompletionEvent(TaskPool* pool, TaskCompletion* completion);
+/// @brief Resets the completion's eventfd and lets it signal again
+void tpAcknowledgeCompletionEvent(TaskPool* pool, TaskCompletion* completion);
+/// @brief Unbinds the completion and closes its eventfd. Destroying the pool
+///     does this for every bound completion
+void tpDestroyCompletionEvent(TaskPool* pool, TaskCompletion* completion);
+
 /// @brief This will wait until the specified completion is 0. The calling thread
-///     will help process tasks while it's waiting.
+///     will help process tasks while it's waiting, unless it doesn't belong to
+///     the pool, in which case it only yields.
 /// @param [in] completion The compeltion event to wait for
 void tpWaitForCompletion(TaskPool* pool, TaskCompletion* completion);
 
+/// @brief Creates a completion that counts in a shard per thread, for large
+///     fan-outs. It can't be bound to an eventfd
+/// @return The completion, or NULL if allocation failed
+ShardedCompletion* tpCreateShardedCompletion(TaskPool* pool);
+/// @brief Frees a sharded completion. No task may still be counted in it
+void tpDestroyShardedCompletion(TaskPool* pool, ShardedCompletion* completion);
+/// @brief Spawns a task like tpSpawnTask that counts in a sharded completion
+void tpSpawnShardedTask(TaskPool* pool, TaskFunction* function, void* data,
+                        ShardedCompletion* completion);
+/// @brief Returns non-zero if every task counted in the completion finished
+int tpIsShardedCompletionDone(ShardedCompletion const* completion);
+/// @brief Waits like tpWaitForCompletion until every task counted in the
+///     completion finished
+void tpWaitForShardedCompletion(TaskPool* pool, ShardedCompletion* completion);
+
+/// @brief Creates a group that owns the completion of the tasks spawned into
+///     it. Waiting on or cancelling a group covers the groups nested in it
+/// @param [in] parent The group this one is nested in, or NULL
+/// @return The group, or NULL if allocation failed
+TaskGroup* tpCreateTaskGroup(TaskPool* pool, TaskGroup* parent);
+/// @brief Waits for the group like tpWaitForTaskGroup, then frees it. Groups
+///     nested in it must be destroyed first
+void tpDestroyTaskGroup(TaskGroup* group);
+/// @brief Spawns a task that counts in the group and is skipped if the group
+///     is cancelled before it starts
+void tpSpawnGroupTask(TaskGroup* group, TaskFunction* function, void* data);
+/// @brief Forks like tpForkTaskWithPolicy, with both halves counted in the
+///     group and skipped if it is cancelled before they start
+void tpForkGroupTask(TaskGroup* group, TaskFunction* child, void* child_data,
+                     TaskFunction* continuation, void* continuation_data, int policy);
+/// @brief Sets a function that is called with a skipped task's data in place
+///     of the task's function. Nested groups don't inherit it
+void tpSetTaskGroupSkipFunction(TaskGroup* group, TaskFunction* function);
+/// @brief Waits until every task of the group and of the groups nested in it
+///     finished, helping with the group's own tasks first
+void tpWaitForTaskGroup(TaskGroup* group);
+/// @brief Cancels the group and every group nested in it, including ones
+///     nested later. Running tasks see it through tpIsCancelled
+void tpCancelTaskGroup(TaskGroup* group);
+/// @brief Returns non-zero if the group or a group it is nested in was
+///     cancelled
+int tpIsTaskGroupCancelled(TaskGroup const* group);
+/// @brief Adds up the counts of the group and every group nested in it
+void tpGetTaskGroupStats(TaskGroup* group, TaskGroupStats* stats);
+
+/// @brief Runs one pending task on the calling thread, if there is one
+/// @return 1 if a task was run, 0 if none was available or the calling thread
+///     doesn't belong to the pool
+int tpRunPendingTask(TaskPool* pool);
+
 /// @brief This spins until all remaining work in the pool has completed. While
 ///     theres still work to be done, the caller thread helps complete it.
 void tpFinishAllWork(TaskPool* pool);
@@ -0,0 +1,111 @@
+#pragma once
+#include <stdint.h>
+#include <assert.h>
+#include <atomic>
+
+/// @brief Bounded multi-producer/multi-consumer queue, after Dmitry Vyukov's
+///     array-based queue. Every cell carries a sequence number that tells
+///     producers and consumers which lap of the ring it belongs to, so both
+///     ends only need a CAS on their own position.
+template<typename T, uint32_t kMaxCount = 4096>
+class InjectQueue {
+public:
+    InjectQueue()
+    {
+        for (uint32_t ii = 0; ii < kMaxCount; ++ii) {
+            this->_cells[ii].sequence.store(ii, std::memory_order_relaxed);
+        }
+    }
+
+    /// @brief Returns a rough estimate of how many items are in the queue
+    int64_t size()const
+    {
+        uint64_t const tail = this->_tail.load(std::memory_order_relaxed);
+        uint64_t const head = this->_head.load(std::memory_order_relaxed);
+        return (int64_t)(tail - head);
+    }
+
+    /// @brief Pushes a new item onto the tail of the queue
+    /// @return 0 on success, 1 on failure (queue is full)
+    int push(T const& value)
+    {
+        uint64_t tail = this->_tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = this->_cells[tail & kQueueMask];
+            uint64_t const sequence = cell.sequence.load(std::memory_order_acquire);
+            int64_t const diff = (int64_t)(sequence - tail);
+            if (diff == 0) {
+                if (this->_tail.compare_exchange_weak(tail, tail + 1,
+                                                      std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(tail + 1, std::memory_order_release);
+                    return 0;
+                }
+            } else if (diff < 0) {
+                return 1;
+            } else {
+                tail = this->_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// @brief Pops the item at the head of the queue
+    /// @return 1 if an item was written to value, 0 if the queue was empty
+    int pop(T* value)
+    {
+        return this->pop_batch(value, 1);
+    }
+
+    /// @brief Pops up to max_count consecutive items with a single CAS
+    /// @return The number of items written to values
+    int pop_batch(T* values, int max_count)
+    {
+        uint64_t head = this->_head.load(std::memory_order_relaxed);
+        for (;;) {
+            // count how many cells from the head are already published
+            int count = 0;
+            while (count < max_count) {
+                Cell const& cell = this->_cells[(head + count) & kQueueMask];
+                uint64_t const sequence = cell.sequence.load(std::memory_order_acquire);
+                if (sequence != head + count + 1) {
+                    break;
+                }
+                ++count;
+            }
+            if (count == 0) {
+                Cell const& cell = this->_cells[head & kQueueMask];
+                int64_t const diff = (int64_t)(cell.sequence.load(std::memory_order_acquire) - (head + 1));
+                if (diff < 0) {
+                    return 0; // empty, or the producer hasn't finished writing
+                }
+                head = this->_head.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (this->_head.compare_exchange_weak(head, head + count,
+                                                  std::memory_order_relaxed)) {
+                for (int ii = 0; ii < count; ++ii) {
+                    Cell& cell = this->_cells[(head + ii) & kQueueMask];
+                    values[ii] = cell.value;
+                    cell.sequence.store(head + ii + kMaxCount, std::memory_order_release);
+                }
+                return count;
+            }
+        }
+    }
+
+private:
+    enum {
+        kQueueMask = kMaxCount - 1,
+        kCacheLineSize = 64,
+    };
+    static_assert((kMaxCount & kQueueMask) == 0, "kMaxCount must be a power of two");
+
+    struct Cell {
+        std::atomic<uint64_t>   sequence;
+        T                       value;
+    };
+
+    Cell                    _cells[kMaxCount];
+    alignas(kCacheLineSize) std::atomic<uint64_t> _tail = {0};
+    alignas(kCacheLineSize) std::atomic<uint64_t> _head = {0};
+};
@@ -0,0 +1,222 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+// kernel headers older than 5.1 have no io_uring.h at all
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        #include <sys/mman.h>
+        #include <sys/syscall.h>
+        #include <unistd.h>
+        #if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+            #define TP_HAVE_IO_URING 1
+        #endif
+    #endif
+#endif
+
+#if defined(TP_HAVE_IO_URING)
+
+/// @brief A minimal io_uring on raw system calls, so there's no dependency on
+///     liburing. Queueing and submitting entries must be serialized by the
+///     caller, and so must reaping completions; the two sides can run
+///     concurrently, and waiting for completions needs no lock at all.
+class IoRing {
+public:
+    IoRing() = default;
+    ~IoRing() { this->destroy(); }
+
+    /// @return 0, or a negative errno if io_uring isn't usable. Kernels older
+    ///     than 5.6 lack IORING_OP_READ and are reported as unsupported
+    int create(unsigned entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int const fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            return -errno;
+        }
+        this->_fd = fd;
+        if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+            this->destroy();
+            return -ENOSYS;
+        }
+
+        this->_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        this->_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool const single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap && this->_cq_size > this->_sq_size) {
+            this->_sq_size = this->_cq_size;
+        }
+        this->_sq_ring = this->_map(this->_sq_size, IORING_OFF_SQ_RING);
+        this->_cq_ring = single_mmap ? this->_sq_ring : this->_map(this->_cq_size, IORING_OFF_CQ_RING);
+        this->_sqes = (struct io_uring_sqe*)this->_map(params.sq_entries * sizeof(struct io_uring_sqe),
+                                                       IORING_OFF_SQES);
+        this->_num_sqes = params.sq_entries;
+        if (this->_sq_ring == nullptr || this->_cq_ring == nullptr || this->_sqes == nullptr) {
+            int const error = errno;
+            this->destroy();
+            return -error;
+        }
+
+        char* const sq = (char*)this->_sq_ring;
+        this->_sq_head = (unsigned*)(sq + params.sq_off.head);
+        this->_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        this->_sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        this->_sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+        this->_sq_array = (unsigned*)(sq + params.sq_off.array);
+        char* const cq = (char*)this->_cq_ring;
+        this->_cq_head = (unsigned*)(cq + params.cq_off.head);
+        this->_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        this->_cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        this->_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+        return 0;
+    }
+
+    void destroy()
+    {
+        if (this->_sqes) {
+            munmap(this->_sqes, this->_num_sqes * sizeof(struct io_uring_sqe));
+        }
+        if (this->_cq_ring && this->_cq_ring != this->_sq_ring) {
+            munmap(this->_cq_ring, this->_cq_size);
+        }
+        if (this->_sq_ring) {
+            munmap(this->_sq_ring, this->_sq_size);
+        }
+        if (this->_fd >= 0) {
+            close(this->_fd);
+        }
+        this->_sqes = nullptr;
+        this->_cq_ring = nullptr;
+        this->_sq_ring = nullptr;
+        this->_fd = -1;
+    }
+
+    /// @brief Queues a read without submitting it
+    /// @return 0, or non-zero if the submission queue is full
+    int prepare_read(int fd, void* buffer, unsigned size, uint64_t offset, uint64_t user_data)
+    {
+        struct io_uring_sqe* sqe = this->_next_sqe();
+        if (sqe == nullptr) {
+            return 1;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        this->_publish();
+        return 0;
+    }
+    /// @brief Queues an operation that completes right away, which wakes a
+    ///     thread blocked in wait
+    int prepare_nop(uint64_t user_data)
+    {
+        struct io_uring_sqe* sqe = this->_next_sqe();
+        if (sqe == nullptr) {
+            return 1;
+        }
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = user_data;
+        this->_publish();
+        return 0;
+    }
+
+    /// @brief The number of queued entries that haven't been submitted
+    unsigned pending()const { return this->_pending; }
+
+    /// @brief Hands all queued entries to the kernel in a single system call
+    /// @return The number of entries submitted, or a negative errno
+    int submit()
+    {
+        if (this->_pending == 0) {
+            return 0;
+        }
+        int const result = (int)syscall(__NR_io_uring_enter, this->_fd, this->_pending, 0, 0, nullptr, 0);
+        if (result < 0) {
+            return -errno;
+        }
+        this->_pending -= (unsigned)result;
+        return result;
+    }
+
+    /// @brief Blocks until at least one completion is available
+    /// @return 0, or a negative errno such as -EINTR
+    int wait()
+    {
+        int const result = (int)syscall(__NR_io_uring_enter, this->_fd, 0, 1,
+                                        IORING_ENTER_GETEVENTS, nullptr, 0);
+        return result < 0 ? -errno : 0;
+    }
+
+    /// @brief Calls function(user_data, result) for up to max_count
+    ///     completions, oldest first
+    /// @return The number of completions reaped
+    template<typename Function>
+    int reap(Function&& function, int max_count)
+    {
+        unsigned head = *this->_cq_head;
+        unsigned const tail = __atomic_load_n(this->_cq_tail, __ATOMIC_ACQUIRE);
+        int count = 0;
+        while (head != tail && count < max_count) {
+            struct io_uring_cqe const* cqe = &this->_cqes[head & this->_cq_mask];
+            function(cqe->user_data, cqe->res);
+            ++head;
+            ++count;
+        }
+        __atomic_store_n(this->_cq_head, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+private:
+    void* _map(size_t size, off_t offset)
+    {
+        void* const memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, this->_fd, offset);
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    struct io_uring_sqe* _next_sqe()
+    {
+        unsigned const head = __atomic_load_n(this->_sq_head, __ATOMIC_ACQUIRE);
+        unsigned const tail = *this->_sq_tail;
+        if (tail - head >= this->_sq_entries) {
+            return nullptr;
+        }
+        struct io_uring_sqe* sqe = &this->_sqes[tail & this->_sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+    void _publish()
+    {
+        unsigned const tail = *this->_sq_tail;
+        this->_sq_array[tail & this->_sq_mask] = tail & this->_sq_mask;
+        __atomic_store_n(this->_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++this->_pending;
+    }
+
+    int         _fd = -1;
+    void*       _sq_ring = nullptr;
+    void*       _cq_ring = nullptr;
+    size_t      _sq_size = 0;
+    size_t      _cq_size = 0;
+    unsigned    _num_sqes = 0;
+    unsigned    _pending = 0;
+
+    unsigned*   _sq_head = nullptr;
+    unsigned*   _sq_tail = nullptr;
+    unsigned*   _sq_array = nullptr;
+    unsigned    _sq_mask = 0;
+    unsigned    _sq_entries = 0;
+    struct io_uring_sqe* _sqes = nullptr;
+
+    unsigned*   _cq_head = nullptr;
+    unsigned*   _cq_tail = nullptr;
+    unsigned    _cq_mask = 0;
+    struct io_uring_cqe* _cqes = nullptr;
+};
+
+#endif // defined(TP_HAVE_IO_URING)
@@ -0,0 +1,124 @@
+#pragma once
+#include <stdint.h>
+#include <thread>
+#include <condition_variable>
+#include "task-pool/task-pool.h"
+
+/* scheduler policies. The pool instantiates its worker loop once per
+ * combination of a queue, a victim, an idle and a wake policy, so the
+ * decisions inline into the loop; see SchedulerPolicy. Each policy is a
+ * struct of static functions, the callback ones forward to a
+ * SchedulerCallbacks table for strategies that aren't built in */
+
+/// @brief Per-thread state for the policies, owned by the thread
+struct SchedulerContext {
+    uint64_t                    random_state; // never 0
+    int                         first_victim;
+    SchedulerCallbacks const*   callbacks; // NULL unless the pool has some
+};
+
+/// @brief Queue choice: spawns go into the spawning thread's own queue
+struct OwnQueues {
+    enum { kUseCpuQueues = 0 };
+};
+/// @brief Queue choice: spawns go into the queue of the current CPU first,
+///     and threads look there after their own queue
+struct CpuQueues {
+    enum { kUseCpuQueues = 1 };
+};
+
+/// @brief Victim selection: the threads after the thief, in order
+struct RoundRobinVictims {
+    /// @return The slot to steal from on the thief's attempt-th try out of
+    ///     num_slots - 1, which may be self to skip the try
+    static int victim(SchedulerContext&, int self, int num_slots, int attempt)
+    {
+        return (self + 1 + attempt) % num_slots;
+    }
+};
+/// @brief Victim selection: the other threads in order, starting at a random
+///     one so thieves don't all line up on the same victim
+struct RandomVictims {
+    static int victim(SchedulerContext& context, int self, int num_slots, int attempt)
+    {
+        int const num_others = num_slots - 1;
+        if (attempt == 0) {
+            // xorshift64
+            uint64_t state = context.random_state;
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            context.random_state = state;
+            context.first_victim = (int)(state % (uint64_t)num_others);
+        }
+        return (self + 1 + (context.first_victim + attempt) % num_others) % num_slots;
+    }
+};
+/// @brief Victim selection through SchedulerCallbacks::select_victim
+struct CallbackVictims {
+    static int victim(SchedulerContext& context, int self, int num_slots, int attempt)
+    {
+        SchedulerCallbacks const* callbacks = context.callbacks;
+        int const victim = callbacks->select_victim(callbacks->user_data, self, num_slots, attempt);
+        return victim >= 0 && victim < num_slots ? victim : self;
+    }
+};
+
+/// @brief Idle policy: sleep as soon as a look for work comes up empty
+struct SleepWhenIdle {
+    /// @return true to look for work again instead of sleeping, after
+    ///     idle_rounds looks came up empty in a row
+    static bool keep_looking(SchedulerContext&, int, int)
+    {
+        return false;
+    }
+};
+/// @brief Idle policy: yield and look again a few times before sleeping,
+///     which trades CPU time for waking up faster in bursty workloads
+struct SpinWhenIdle {
+    enum { kSpinRounds = 64 };
+    static bool keep_looking(SchedulerContext&, int, int idle_rounds)
+    {
+        if (idle_rounds >= kSpinRounds) {
+            return false;
+        }
+        std::this_thread::yield();
+        return true;
+    }
+};
+/// @brief Idle policy through SchedulerCallbacks::keep_spinning
+struct CallbackIdle {
+    static bool keep_looking(SchedulerContext& context, int self, int idle_rounds)
+    {
+        SchedulerCallbacks const* callbacks = context.callbacks;
+        if (callbacks->keep_spinning(callbacks->user_data, self, idle_rounds) == 0) {
+            return false;
+        }
+        std::this_thread::yield();
+        return true;
+    }
+};
+
+/// @brief Wake policy: every spawn wakes every sleeping worker
+struct WakeAll {
+    static void wake(std::condition_variable& condition)
+    {
+        condition.notify_all();
+    }
+};
+/// @brief Wake policy: every spawn wakes a single sleeping worker
+struct WakeOne {
+    static void wake(std::condition_variable& condition)
+    {
+        condition.notify_one();
+    }
+};
+
+/// @brief A combination of the policies above
+template<typename Queue, typename Victims, typename Idle, typename Wake>
+struct SchedulerPolicy {
+    typedef Queue   QueuePolicy;
+    typedef Victims VictimPolicy;
+    typedef Idle    IdlePolicy;
+    typedef Wake    WakePolicy;
+};
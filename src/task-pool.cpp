@@ -1,14 +1,37 @@
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <thread>
+#include <chrono>
 #include <condition_variable>
+#include <mutex>
 #include "task-pool/task-pool.h"
 #include "task-queue.hpp"
+#include "inject-queue.hpp"
+#include "timer-wheel.hpp"
+#include "io-ring.hpp"
+#include "scheduler-policy.hpp"
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+#if defined(__linux__)
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sched.h>
+    #define TP_HAVE_EPOLL 1
+    #define TP_HAVE_EVENTFD 1
+    #define TP_HAVE_SCHED_GETCPU 1
+#endif
 
 #if defined(_MSC_VER)
     #include <intrin.h>
     #define ALIGN(x) alignas(x)
-    #define AtomicAdd(val, add) _InterlockedExchangeAdd((volatile long*)val, add)
+    #define AtomicAdd(val, add) (_InterlockedExchangeAdd((volatile long*)val, add) + add)
 #elif defined(__GNUC__)
     #define ALIGN(x) alignas(x)
     #define AtomicAdd(val, add) __sync_add_and_fetch(val, add)
@@ -27,6 +50,17 @@
 enum {
     kMaxTasks = 1024,
     kTasksMask = kMaxTasks - 1,
+    kMaxInjectedTasks = 4096,
+    kInjectBatchSize = 16,
+    kMicrosecondsPerTick = 1000,
+    kIoRingEntries = 256,
+    kMaxIoInFlight = kIoRingEntries, // the completion queue holds twice that
+    kIoBatchSize = 32,
+    kMaxIoSize = 0x7ffff000, // the most a single read returns on Linux
+    kMaxFdEvents = 32,
+    kMaxCompletionEvents = 32,
+    kMaxHelpDepth = 8, // nested waits that still take unrelated tasks
+    kMaxHelpStalls = 64, // see _WaitUntil
 };
 
 /* struct definitions */
@@ -34,29 +68,324 @@ struct ALIGN(CACHE_LINE_SIZE) Task {
     TaskFunction*   function;
     void*           user_data;
     TaskCompletion* completion;
+    TaskCancellation const* cancellation;
 
     // pad the task to the average current cache line size (64 bytes) to avoid
     // false sharing
-    char    _padding[CACHE_LINE_SIZE - (sizeof(void*) * 3)];
+    char    _padding[CACHE_LINE_SIZE - (sizeof(void*) * 4)];
+};
+
+/* tasks submitted by threads without a queue of their own are stored by
+ * value until a worker moves them into its task storage */
+struct InjectedTask {
+    TaskFunction*   function;
+    void*           user_data;
+    TaskCompletion* completion;
+    TaskCancellation const* cancellation;
+};
+
+/* a task that found no room under kAdmitSpill, allocated on its own */
+struct SpilledTask {
+    SpilledTask*    next;
+    InjectedTask    task;
+};
+
+/* delayed and periodic tasks waiting in the timer wheel. Deadlines and periods
+ * are in ticks */
+struct Timer {
+    Timer*          next;
+    uint64_t        deadline;
+    uint64_t        period; // 0 for one-shot timers
+    TaskFunction*   function;
+    void*           user_data;
+    TaskCompletion* completion;
+    TaskCancellation const* cancellation;
+    Timer*          next_allocated; // every timer the pool owns, for cleanup
+};
+
+/* an asynchronous read, from tpReadAsync until its function has run */
+struct IoRequest {
+    IoRequest*      next; // free list or the helper thread's queue
+    IoRequest*      next_allocated;
+    TaskPool*       pool;
+    AsyncIoFunction* function;
+    void*           user_data;
+    TaskCompletion* completion;
+    int             fd;
+    void*           buffer;
+    size_t          size;
+    uint64_t        offset;
+    int64_t         result;
+};
+
+/* asynchronous I/O, set up by the first tpReadAsync. The mutex guards setup,
+ * submission, the request free list and the helper thread's queue */
+struct AsyncIo {
+    std::mutex          mutex;
+    std::mutex          reap_mutex;
+    std::condition_variable condition; // wakes the blocking helper thread
+    std::atomic<bool>   started = {false};
+    bool                disable_ring = false;
+    bool                use_ring = false;
+    bool                stopping = false;
+    std::atomic<int>    pending = {0}; // queued but not submitted yet
+    std::atomic<int>    in_flight = {0}; // queued or submitted, not reaped
+    IoRequest*          free_requests = nullptr;
+    IoRequest*          allocated_requests = nullptr;
+    IoRequest*          blocking_head = nullptr;
+    IoRequest*          blocking_tail = nullptr;
+    std::thread         thread;
+#if defined(TP_HAVE_IO_URING)
+    IoRing              ring;
+#endif
+};
+
+/* a watched fd. epoll reports the fd together with the generation the watch
+ * was armed with, so events for a watch that has since been replaced or
+ * removed are dropped */
+struct FdWatch {
+    WatchFunction*  function;
+    void*           user_data;
+    uint32_t        generation;
+    bool            armed;
+};
+
+/* a fired watch, on its way to its function */
+struct WatchEvent {
+    WatchEvent*     next; // free list
+    WatchEvent*     next_allocated;
+    TaskPool*       pool;
+    WatchFunction*  function;
+    void*           user_data;
+    int             events;
+};
+
+/* readiness watches, set up by the first tpWatchFd. The mutex guards setup,
+ * the watches, which are indexed by fd, and the event free list. One worker
+ * at a time holds the polling role and may block in epoll_wait on wait_fd,
+ * which holds epoll_fd and the eventfd the others wake it through. Workers
+ * that only look poll epoll_fd, so they can't swallow a wake-up */
+struct Reactor {
+    std::mutex          mutex;
+    std::atomic<bool>   started = {false};
+    std::atomic<int>    num_armed = {0};
+    std::atomic<bool>   polling = {false};
+    std::atomic<bool>   poller_asleep = {false};
+    int                 epoll_fd = -1;
+    int                 wait_fd = -1;
+    int                 wake_fd = -1;
+    FdWatch*            watches = nullptr;
+    int                 num_watches = 0;
+    WatchEvent*         free_events = nullptr;
+    WatchEvent*         allocated_events = nullptr;
+};
+
+/* an eventfd that is written when its completion reaches zero. Only the
+ * write that disarms it goes through until the eventfd is acknowledged, so a
+ * burst of completions costs a single write. Signalling threads count
+ * themselves in writers so the eventfd isn't closed under them */
+struct CompletionEvent {
+    std::atomic<TaskCompletion const*> completion = {nullptr};
+    std::atomic<bool>   armed = {false};
+    std::atomic<int>    writers = {0};
+    int                 fd = -1;
+};
+
+/* deterministic mode runs tasks one at a time, picking the next one with a
+ * seeded generator. The workers run them in lockstep: after each task the
+ * generator picks the worker whose turn is next. The mutex guards the
+ * pending tasks and the turn; the run mutex lets one thread run tasks at a
+ * time and is taken again when a running task waits */
+struct SeededTask {
+    TaskFunction*   function;
+    void*           user_data;
+    TaskCompletion* completion;
+    TaskCancellation const* cancellation;
+};
+struct SeededScheduler {
+    std::mutex          mutex;
+    std::recursive_mutex run_mutex;
+    std::condition_variable condition; // signalled on spawns and turns
+    uint64_t            random_state = 0;
+    int                 turn = 0; // the worker that runs the next task
+    SeededTask*         tasks = nullptr;
+    int                 num_tasks = 0;
+    int                 max_tasks = 0;
 };
 
 struct Thread {
     Task                    tasks[kMaxTasks];
     TaskQueue<kMaxTasks>    queue;
+
+    // written on every spawn and task by the owner only
+    ALIGN(CACHE_LINE_SIZE) uint64_t num_tasks;
+    std::atomic<uint64_t> num_spawned; // see _CountSpawned
+    std::atomic<uint64_t> num_finished;
     TaskPool*   pool;
-    std::thread thread;
-    uint64_t    num_tasks;
     int         thread_id;
+    int         help_depth; // waits the thread is helping in, see _WaitUntil
+    int         inline_depth; // tasks spawned inline on the stack, see _ShouldSpawnInline
+    bool        admitting; // helping while a spawn waits for room, see _SpawnTask
+    SchedulerContext scheduler_context;
+
+    // written by the thieves that take from the queue
+    ALIGN(CACHE_LINE_SIZE) std::atomic<int> last_thief; // -1 before the first steal
+    std::atomic<int> num_stored; // unreleased tasks in storage, external slots only
+
+    // cold
+    std::atomic<bool> registered; // external slots only
+    std::thread thread;
+};
+
+/* a queue shared by whichever threads run on one CPU. Taking owned makes a
+ * thread the owner for a push or a pop, thieves don't need it */
+struct CpuQueue {
+    std::atomic<bool>       owned;
+    TaskQueue<kMaxTasks>    queue;
+};
+
+/* a completion with one shard per slot, plus a last one shared by threads
+ * without a slot. The counts in a shard only grow, see _IsShardedDone */
+struct ALIGN(CACHE_LINE_SIZE) CompletionShard {
+    std::atomic<uint64_t>   spawned;
+    std::atomic<uint64_t>   finished;
+};
+struct ShardedCompletion {
+    void*           allocation; // what the allocator returned
+    int             num_shards;
+    CompletionShard shards[1];
+};
+
+/* the completion comes first so a pointer to it is also one to the group.
+ * The mutex guards the links to nested groups; cancelling and adding up
+ * stats lock a group before the groups nested in it */
+struct TaskGroup {
+    TaskCompletion          completion = 0;
+    TaskCancellation        cancellation = 0;
+    TaskPool*               pool = nullptr;
+    TaskGroup*              parent = nullptr;
+    TaskGroup*              first_child = nullptr;
+    TaskGroup*              prev_sibling = nullptr;
+    TaskGroup*              next_sibling = nullptr;
+    TaskFunction*           skip_function = nullptr;
+    std::mutex              mutex;
+    // include the nested groups that were destroyed
+    std::atomic<uint64_t>   num_spawned = {0};
+    std::atomic<uint64_t>   num_finished = {0};
+    std::atomic<uint64_t>   num_skipped = {0};
+};
+
+/* the pool's SchedulerPolicy. Code outside the worker loop switches on the
+ * policy kinds into the instantiations for them, which the compiler can
+ * inline where it couldn't an indirect call on every spawn. Workers run
+ * thread_proc, which calls the same instantiations directly */
+enum QueueKind : uint8_t {
+    kOwnQueues,
+    kCpuQueues,
+};
+enum VictimKind : uint8_t {
+    kRoundRobinVictims,
+    kRandomVictims,
+    kCallbackVictims,
+};
+enum IdleKind : uint8_t {
+    kSleepWhenIdle,
+    kSpinWhenIdle,
+    kCallbackIdle,
+};
+enum WakeKind : uint8_t {
+    kWakeAllWorkers,
+    kWakeOneWorker,
+};
+struct Scheduler {
+    QueueKind   queues;
+    VictimKind  victims;
+    IdleKind    idle;
+    WakeKind    wake;
+    void        (*thread_proc)(Thread* thread);
 };
 
+/* fields are grouped by who writes them, and each group that is written
+ * while tasks run starts a cache line of its own so the writes don't evict
+ * what the workers only read */
 struct TaskPool {
+    // read on every spawn and task, written at creation or rarely
     AllocationCallbacks allocator;
-    std::condition_variable wake_condition;
-    std::mutex          wake_mutex;
-    std::atomic<bool>   running;
-    std::atomic<int>    num_idle_threads = {0};
-    std::atomic<int>    in_progress_tasks = {0};
+    void*               allocation; // what the allocator returned for the pool
+    uint64_t            serial;
     int                 num_threads;
+    int                 num_spare_threads;
+    int                 num_external_threads;
+    int                 num_slots; // all threads, spares and external included
+    bool                deterministic = false;
+    bool                asymmetric_fences = false;
+    std::atomic<bool>   running;
+    // per-CPU queues, checked after the thread's own queue
+    int                 num_cpu_queues = 0;
+    CpuQueue*           cpu_queues = nullptr;
+    void*               cpu_queue_allocation = nullptr;
+
+    // auto-scaling, disabled while auto_scale_idle_ms is 0
+    std::atomic<int>    auto_scale_min = {0};
+    std::atomic<int>    auto_scale_max = {0};
+    std::atomic<int>    auto_scale_idle_ms = {0};
+    std::atomic<int>    auto_scale_depth = {0};
+
+    // inline spawns, disabled while max_inline_depth is 0
+    std::atomic<int>    inline_queue_depth = {0};
+    std::atomic<int>    max_inline_depth = {0};
+
+    // admission control, see AdmissionPolicy
+    int                 admission_policy = kAdmitBlock;
+    int64_t             max_in_flight = 0; // 0 for no limit
+    int                 spawn_policy = kSpawnHelpFirst; // for forks, see SpawnPolicy
+    Scheduler           scheduler;
+    SchedulerCallbacks  scheduler_callbacks;
+
+    // tasks spawned and finished by threads without a slot, the threads
+    // with one count in their own Thread
+    ALIGN(CACHE_LINE_SIZE) std::atomic<uint64_t> external_spawned = {0};
+    std::atomic<uint64_t> external_finished = {0};
+
+    // spawned and not finished yet, only counted while max_in_flight isn't 0
+    ALIGN(CACHE_LINE_SIZE) std::atomic<int64_t> num_in_flight = {0};
+
+    // written when workers go to sleep and wake up
+    ALIGN(CACHE_LINE_SIZE) std::atomic<int> num_idle_threads = {0};
+    std::atomic<int>    num_started_threads = {0}; // written once by each worker
+    std::mutex          wake_mutex;
+    std::condition_variable wake_condition;
+    std::condition_variable park_condition;
+
+    // read after every task, written when workers block or scale
+    ALIGN(CACHE_LINE_SIZE) std::atomic<int> num_active_workers = {0};
+    std::atomic<int>    num_blocking_threads = {0};
+
+    InjectQueue<InjectedTask, kMaxInjectedTasks> inject_queue;
+
+    // spilled tasks in spawn order, num_spilled can be read without the lock
+    std::mutex          spill_mutex;
+    SpilledTask*        spill_head = nullptr;
+    SpilledTask*        spill_tail = nullptr;
+    std::atomic<int>    num_spilled = {0};
+
+    // timers, next_timer_tick can be read without the lock
+    std::mutex          timer_mutex;
+    TimerWheel<Timer>   timers;
+    Timer*              free_timers = nullptr;
+    Timer*              allocated_timers = nullptr;
+    std::atomic<uint64_t> next_timer_tick = {TimerWheel<Timer>::kNoDeadline};
+
+    AsyncIo             io;
+    Reactor             reactor;
+
+    // completions bound to eventfds, slots are claimed under the mutex
+    std::mutex          completion_event_mutex;
+    std::atomic<int>    num_completion_events = {0};
+    CompletionEvent     completion_events[kMaxCompletionEvents];
+
+    SeededScheduler     seeded;
+
     Thread              threads[1];
 };
 
@@ -64,8 +393,25 @@ struct TaskPool {
 namespace {
 
 
-/* thread-local thread id */
-thread_local int _thread_id;
+/* thread-local thread ids, one per pool the thread belongs to. The most
+ * recently used pool is kept first so the common single-pool case is a single
+ * compare. The serial tells a pool apart from an earlier one that was
+ * allocated at the same address */
+enum {
+    kMaxPoolsPerThread = 8,
+};
+struct PoolIdentity {
+    TaskPool const* pool;
+    uint64_t        serial;
+    int             thread_id;
+};
+thread_local PoolIdentity _identities[kMaxPoolsPerThread];
+
+/* cancellation of the task running on this thread, for tpIsCancelled */
+thread_local TaskCancellation const* _current_cancellation;
+/* seeded tasks running on this thread's stack, see _RunsSeededTasks */
+thread_local int _seeded_depth;
+std::atomic<uint64_t> _next_pool_serial = {1};
 
 /* static methods */
 void* _DefaultAllocate(size_t size, void* user_data)
@@ -84,172 +430,2633 @@ AllocationCallbacks const kDefaultAllocator = {
     nullptr,
 };
 
-Task* _GetTask(Thread* thread)
+/* allocators only promise malloc's alignment, so over-allocate to start the
+ * block on a cache line. The returned pointer goes in *allocation for
+ * free_function */
+void* _AllocateAligned(AllocationCallbacks const* allocator, size_t size, void** allocation)
 {
-    TaskPool* pool = thread->pool;
-    Task* task = thread->queue.pop();
-    if (task == nullptr) {
-        // round robin through threads
-        for (int ii = 1; ii < pool->num_threads; ++ii) {
-            int const other_thread_id = (_thread_id + ii) % pool->num_threads;
-            assert(other_thread_id >= 0);
-            assert(other_thread_id < pool->num_threads);
-            auto& other_queue = pool->threads[other_thread_id].queue;
+    char* const memory = (char*)allocator->allocate_function(size + CACHE_LINE_SIZE - 1,
+                                                             allocator->user_data);
+    *allocation = memory;
+    if (memory == nullptr) {
+        return nullptr;
+    }
+    uintptr_t const aligned = ((uintptr_t)memory + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    return (void*)aligned;
+}
 
-            task = other_queue.steal();
-            if (task) {
-                return task;
-            }
+/* returns the calling thread's id in the pool, or -1 if it has no queue */
+int _ThreadId(TaskPool const* pool)
+{
+    if (_identities[0].pool == pool && _identities[0].serial == pool->serial) {
+        return _identities[0].thread_id;
+    }
+    for (int ii = 1; ii < kMaxPoolsPerThread; ++ii) {
+        if (_identities[ii].pool == pool && _identities[ii].serial == pool->serial) {
+            PoolIdentity const identity = _identities[ii];
+            memmove(&_identities[1], &_identities[0], sizeof(_identities[0]) * ii);
+            _identities[0] = identity;
+            return identity.thread_id;
         }
     }
-    return task;
+    return -1;
 }
 
-void _RunTask(TaskPool* pool, Task* task)
+void _SetThreadId(TaskPool const* pool, int thread_id)
 {
-    task->function(_thread_id, task->user_data);
-    pool->in_progress_tasks--;
-    AtomicAdd(task->completion, -1);
-    task->completion = nullptr;
+    // forget the least recently used pool if the thread is in too many
+    int ii = 0;
+    while (ii < kMaxPoolsPerThread - 1 && _identities[ii].pool != pool) {
+        ++ii;
+    }
+    memmove(&_identities[1], &_identities[0], sizeof(_identities[0]) * ii);
+    _identities[0].pool = pool;
+    _identities[0].serial = pool->serial;
+    _identities[0].thread_id = thread_id;
 }
 
-Task* _AllocateTask(TaskPool* pool)
+void _ClearThreadId(TaskPool const* pool)
 {
-    Thread& thread = pool->threads[_thread_id];
-    Task* task = nullptr;
-    do {
-        uint64_t const index = thread.num_tasks++;
-        task = &thread.tasks[index & kTasksMask];
-    } while (task->completion);
-    return task;
+    for (int ii = 0; ii < kMaxPoolsPerThread; ++ii) {
+        if (_identities[ii].pool == pool) {
+            memmove(&_identities[ii], &_identities[ii + 1],
+                    sizeof(_identities[0]) * (kMaxPoolsPerThread - ii - 1));
+            memset(&_identities[kMaxPoolsPerThread - 1], 0, sizeof(_identities[0]));
+            return;
+        }
+    }
 }
 
-void _ThreadProc(Thread* thread)
+/* wakes the worker blocked in epoll_wait, if any */
+void _WakePoller(TaskPool* pool)
 {
-    assert(thread != nullptr);
-    assert(thread->pool != nullptr);
-    TaskPool* pool = thread->pool;
-    _thread_id = thread->thread_id;
-    do {
-        // sleep
-        {
-            std::unique_lock<std::mutex> lock(pool->wake_mutex);
-            if (pool->running.load() == false) {
-                break;
-            }
-            pool->num_idle_threads++;
-            pool->wake_condition.wait(lock);
-            pool->num_idle_threads--;
-        }
-        if (pool->running.load() == false) {
-            break;
+#if defined(TP_HAVE_EPOLL)
+    // pairs with the poller publishing poller_asleep before its last look
+    // at the queues
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Reactor& reactor = pool->reactor;
+    if (reactor.poller_asleep.load(std::memory_order_relaxed) && reactor.poller_asleep.exchange(false)) {
+        uint64_t const value = 1;
+        ssize_t const written = write(reactor.wake_fd, &value, sizeof(value));
+        (void)written;
+    }
+#else
+    (void)pool;
+#endif
+}
+
+void _NotifyWorkers(TaskPool* pool)
+{
+    pool->wake_condition.notify_all();
+    _WakePoller(pool);
+}
+
+void _SignalCompletionEvent(TaskPool* pool, TaskCompletion const* completion)
+{
+#if defined(TP_HAVE_EVENTFD)
+    for (int ii = 0; ii < kMaxCompletionEvents; ++ii) {
+        CompletionEvent& event = pool->completion_events[ii];
+        if (event.completion.load() != completion) {
+            continue;
         }
-        Task* task = _GetTask(thread);
-        while (task != nullptr) {
-            _RunTask(pool, task);
-            task = _GetTask(thread);
+        event.writers++;
+        if (event.completion.load() == completion && event.armed.exchange(false)) {
+            uint64_t const value = 1;
+            ssize_t const written = write(event.fd, &value, sizeof(value));
+            (void)written;
         }
-    } while (pool->running.load());
+        event.writers--;
+    }
+#else
+    (void)pool;
+    (void)completion;
+#endif
 }
 
-} // anonymous namespace
+/* sharded completions and task groups travel through the task paths as a
+ * TaskCompletion pointer with one of the low bits set, which an int's
+ * alignment leaves free */
+enum : uintptr_t {
+    kShardedCompletionTag = 1,
+    kTaskGroupTag = 2,
+};
+TaskCompletion* _TagShardedCompletion(ShardedCompletion* completion)
+{
+    return (TaskCompletion*)((uintptr_t)completion | kShardedCompletionTag);
+}
+ShardedCompletion* _AsShardedCompletion(TaskCompletion* completion)
+{
+    if (((uintptr_t)completion & kShardedCompletionTag) == 0) {
+        return nullptr;
+    }
+    return (ShardedCompletion*)((uintptr_t)completion & ~kShardedCompletionTag);
+}
 
-/* public methods */
-TaskPool* tpCreatePool(int num_threads, AllocationCallbacks const* allocator)
+TaskCompletion* _TagTaskGroup(TaskGroup* group)
 {
-    if (allocator == nullptr) {
-        allocator = &kDefaultAllocator;
+    return (TaskCompletion*)((uintptr_t)group | kTaskGroupTag);
+}
+TaskGroup* _AsTaskGroup(TaskCompletion* completion)
+{
+    if (((uintptr_t)completion & kTaskGroupTag) == 0) {
+        return nullptr;
     }
+    return (TaskGroup*)((uintptr_t)completion & ~kTaskGroupTag);
+}
 
-    num_threads = num_threads + 1; // add one for the main thread
-    size_t const total_size = sizeof(TaskPool) + sizeof(Thread) * (num_threads - 1);
-    TaskPool* pool = new (allocator->allocate_function(total_size, allocator->user_data)) TaskPool;
-    if (pool == nullptr) {
-        return pool;
+/* bumps a count in the caller's shard. A slot's shard has a single writer,
+ * the shared one needs an RMW */
+void _AddToShard(TaskPool const* pool, ShardedCompletion* completion,
+                 std::atomic<uint64_t> CompletionShard::* count, std::memory_order order)
+{
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        (completion->shards[completion->num_shards - 1].*count).fetch_add(1, order);
+    } else {
+        std::atomic<uint64_t>& shard_count = completion->shards[thread_id].*count;
+        shard_count.store(shard_count.load(std::memory_order_relaxed) + 1, order);
     }
-    pool->allocator = *allocator;
-    pool->num_threads = num_threads;
-    pool->num_idle_threads = 0;
-    pool->running.store(true);
+}
 
-    memset(pool->threads, 0, sizeof(pool->threads[0])*num_threads);
-    std::atomic_thread_fence(std::memory_order_seq_cst);
+/* true if every task counted in the completion finished: the same double
+ * collect as _IsQuiescent, over the shards */
+bool _IsShardedDone(ShardedCompletion const* completion)
+{
+    uint64_t finished = 0;
+    for (int ii = 0; ii < completion->num_shards; ++ii) {
+        finished += completion->shards[ii].finished.load(std::memory_order_acquire);
+    }
+    uint64_t spawned = 0;
+    for (int ii = 0; ii < completion->num_shards; ++ii) {
+        spawned += completion->shards[ii].spawned.load(std::memory_order_relaxed);
+    }
+    return finished == spawned;
+}
 
-    pool->threads[0].thread_id = _thread_id;
-    pool->threads[0].pool = pool;
-    for (int ii = 1; ii < pool->num_threads; ++ii) {
-        pool->threads[ii].thread_id = ii;
-        pool->threads[ii].pool = pool;
-        assert(pool->threads[ii].pool);
-        pool->threads[ii].thread = std::thread(_ThreadProc, &pool->threads[ii]);
+/* adds one count to a completion */
+void _AcquireCompletion(TaskPool* pool, TaskCompletion* completion)
+{
+    ShardedCompletion* const sharded = _AsShardedCompletion(completion);
+    if (sharded) {
+        _AddToShard(pool, sharded, &CompletionShard::spawned, std::memory_order_relaxed);
+        return;
+    }
+    TaskGroup* const group = _AsTaskGroup(completion);
+    if (group) {
+        group->num_spawned.fetch_add(1, std::memory_order_relaxed);
+        completion = &group->completion;
     }
-    while(pool->num_idle_threads.load() != num_threads-1)
-        ; // wait for all threads to idle
+    AtomicAdd(completion, 1);
+}
 
-    return pool;
+/* called for a task that was skipped because it was cancelled */
+void _SkipTask(int thread_id, TaskCompletion* completion, void* data)
+{
+    TaskGroup* const group = _AsTaskGroup(completion);
+    if (group) {
+        group->num_skipped.fetch_add(1, std::memory_order_relaxed);
+        if (group->skip_function) {
+            group->skip_function(thread_id, data);
+        }
+    }
 }
 
-void tpDestroyPool(TaskPool* pool)
+/* drops one count of a completion, signalling its eventfd at zero */
+void _ReleaseCompletion(TaskPool* pool, TaskCompletion* completion)
 {
-    tpFinishAllWork(pool);
-    {
-        std::lock_guard<std::mutex> lock(pool->wake_mutex);
-        pool->running.store(false);
-        pool->wake_condition.notify_all();
+    ShardedCompletion* const sharded = _AsShardedCompletion(completion);
+    if (sharded) {
+        _AddToShard(pool, sharded, &CompletionShard::finished, std::memory_order_release);
+        return;
     }
-    for (int ii = 1; ii < pool->num_threads; ++ii) {
-        pool->threads[ii].thread.join();
+    TaskGroup* const group = _AsTaskGroup(completion);
+    if (group) {
+        // before the count drops, after which the group may be freed
+        group->num_finished.fetch_add(1, std::memory_order_relaxed);
+        completion = &group->completion;
+    }
+    if (AtomicAdd(completion, -1) == 0 &&
+        pool->num_completion_events.load(std::memory_order_relaxed) != 0) {
+        _SignalCompletionEvent(pool, completion);
     }
-    pool->allocator.free_function(pool, pool->allocator.user_data);
 }
 
-int tpNumThreads(TaskPool const* pool)
+/* every task is counted once when spawned and once when finished, in the
+ * counters of the thread that did it, so the hot path only writes lines the
+ * thread owns. Only that thread writes them, which makes a load and a store
+ * enough. Finishing is a release so _IsQuiescent, which reads every finished
+ * count before any spawned count, sees the spawns that led up to it */
+void _CountSpawned(Thread* thread)
 {
-    if (pool == nullptr) {
-        return 0;
+    uint64_t const count = thread->num_spawned.load(std::memory_order_relaxed);
+    thread->num_spawned.store(count + 1, std::memory_order_relaxed);
+    if (thread->pool->max_in_flight != 0) {
+        thread->pool->num_in_flight.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+void _CountFinished(Thread* thread)
+{
+    uint64_t const count = thread->num_finished.load(std::memory_order_relaxed);
+    thread->num_finished.store(count + 1, std::memory_order_release);
+    if (thread->pool->max_in_flight != 0) {
+        thread->pool->num_in_flight.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+/* the same for callers that may not have a slot */
+void _CountSpawned(TaskPool* pool)
+{
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        pool->external_spawned.fetch_add(1, std::memory_order_relaxed);
+        if (pool->max_in_flight != 0) {
+            pool->num_in_flight.fetch_add(1, std::memory_order_relaxed);
+        }
+    } else {
+        _CountSpawned(&pool->threads[thread_id]);
+    }
+}
+void _CountFinished(TaskPool* pool)
+{
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        pool->external_finished.fetch_add(1, std::memory_order_release);
+        if (pool->max_in_flight != 0) {
+            pool->num_in_flight.fetch_sub(1, std::memory_order_relaxed);
+        }
+    } else {
+        _CountFinished(&pool->threads[thread_id]);
     }
-    return pool->num_threads;
 }
 
-int tpNumIdleThreads(TaskPool const* pool)
+/* true if every task spawned so far has finished. A finish is only counted
+ * after its spawn, and a task's children are spawned before it finishes, so
+ * summing the finished counts first and the spawned counts second can't
+ * produce a match while a counted task is still pending or running */
+bool _IsQuiescent(TaskPool const* pool)
 {
-    if (pool == nullptr) {
-        return 0;
+    uint64_t finished = pool->external_finished.load(std::memory_order_acquire);
+    for (int ii = 0; ii < pool->num_slots; ++ii) {
+        finished += pool->threads[ii].num_finished.load(std::memory_order_acquire);
     }
-    return pool->num_idle_threads;
+    uint64_t spawned = pool->external_spawned.load(std::memory_order_relaxed);
+    for (int ii = 0; ii < pool->num_slots; ++ii) {
+        spawned += pool->threads[ii].num_spawned.load(std::memory_order_relaxed);
+    }
+    return finished == spawned;
 }
 
-void tpSpawnTask(TaskPool* pool, TaskFunction* function, void* data,
-                 TaskCompletion* completion)
+/* external slots count the tasks in their storage, so tpUnregisterThread
+ * can wait for the ones other threads took */
+bool _IsExternalSlot(TaskPool const* pool, int thread_id)
 {
-    AtomicAdd(completion, 1);
-    pool->in_progress_tasks++;
-    Task* task = _AllocateTask(pool);
-    task->completion = completion;
-    task->function = function;
-    task->user_data = data;
-    pool->threads[_thread_id].queue.push(task);
-    pool->wake_condition.notify_all();
+    return thread_id >= pool->num_slots - pool->num_external_threads;
+}
+void _CountStoredTask(Thread* thread)
+{
+    if (_IsExternalSlot(thread->pool, thread->thread_id)) {
+        thread->num_stored.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+/* frees a task's storage, which may belong to another thread than the one
+ * that ran it */
+void _ReleaseTask(TaskPool* pool, Task* task)
+{
+    task->function = nullptr;
+    if (pool->num_external_threads == 0) {
+        return;
+    }
+    Thread* const first = &pool->threads[pool->num_slots - pool->num_external_threads];
+    Thread* const last = &pool->threads[pool->num_slots];
+    if ((char*)task >= (char*)first && (char*)task < (char*)last) {
+        Thread* const owner = &pool->threads[((char*)task - (char*)pool->threads) / sizeof(Thread)];
+        owner->num_stored.fetch_sub(1, std::memory_order_release);
+    }
 }
 
-void tpWaitForCompletion(TaskPool* pool, TaskCompletion* completion)
+Task* _AllocateTask(Thread* thread)
 {
-    while (*completion) {
-        Task* next_task = _GetTask(&pool->threads[_thread_id]);
-        if (next_task) {
-            _RunTask(pool, next_task);
+    Task* task = nullptr;
+    do {
+        uint64_t const index = thread->num_tasks++;
+        task = &thread->tasks[index & kTasksMask];
+    } while (task->function);
+    _CountStoredTask(thread);
+    return task;
+}
+
+/* like _AllocateTask, but gives up after looking at every slot once */
+Task* _TryAllocateTask(Thread* thread)
+{
+    for (int ii = 0; ii < kMaxTasks; ++ii) {
+        uint64_t const index = thread->num_tasks++;
+        Task* task = &thread->tasks[index & kTasksMask];
+        if (task->function == nullptr) {
+            _CountStoredTask(thread);
+            return task;
         }
     }
+    return nullptr;
 }
 
-void tpFinishAllWork(TaskPool* pool)
+/* true while max_in_flight tasks are in flight. Spawners check this before
+ * counting themselves in, so racing ones can overshoot the limit by a few */
+bool _IsPoolFull(TaskPool const* pool)
 {
-    Task* task = _GetTask(&pool->threads[_thread_id]);
-    while (task || pool->in_progress_tasks.load() > 0) {
-        if (task) {
-            _RunTask(pool, task);
+    return pool->max_in_flight != 0 &&
+           pool->num_in_flight.load(std::memory_order_relaxed) >= pool->max_in_flight;
+}
+
+/* a slot for a spawn, or nullptr if the pool or the thread's storage is full */
+Task* _AdmitTask(Thread* thread)
+{
+    return _IsPoolFull(thread->pool) ? nullptr : _TryAllocateTask(thread);
+}
+
+/* returns the queue of the CPU the caller runs on, owned by the caller, or
+ * nullptr if the pool has none or another thread owns it right now. glibc
+ * reads the CPU number out of the thread's rseq area, so this is cheap. The
+ * thread can migrate or be preempted by another thread on the same CPU after
+ * the call, so rechecking the CPU isn't enough: taking ownership costs an
+ * atomic exchange, uncontended unless that happened */
+CpuQueue* _AcquireCpuQueue(TaskPool* pool)
+{
+    if (pool->num_cpu_queues == 0) {
+        return nullptr;
+    }
+    int cpu = 0;
+#if defined(TP_HAVE_SCHED_GETCPU)
+    cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = 0;
+    }
+#endif
+    CpuQueue* cpu_queue = &pool->cpu_queues[cpu % pool->num_cpu_queues];
+    if (cpu_queue->owned.load(std::memory_order_relaxed) ||
+        cpu_queue->owned.exchange(true, std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return cpu_queue;
+}
+void _ReleaseCpuQueue(CpuQueue* cpu_queue)
+{
+    cpu_queue->owned.store(false, std::memory_order_release);
+}
+
+/* pushes a spawned task and wakes workers for it. With CpuQueues the task
+ * goes into the current CPU's queue, or the thread's own queue when that
+ * isn't possible */
+template<typename Queue, typename Wake>
+void _PushTaskWith(Thread* thread, Task* task)
+{
+    TaskPool* pool = thread->pool;
+    CpuQueue* cpu_queue = Queue::kUseCpuQueues ? _AcquireCpuQueue(pool) : nullptr;
+    int full = 1;
+    if (cpu_queue) {
+        full = cpu_queue->queue.push(task);
+        _ReleaseCpuQueue(cpu_queue);
+    }
+    if (full) {
+        // every queued task of the thread holds one of its slots, so there's
+        // room for the one in this slot
+        full = thread->queue.push(task);
+        assert(!full);
+    }
+    Wake::wake(pool->wake_condition);
+    _WakePoller(pool);
+}
+void _PushTask(Thread* thread, Task* task)
+{
+    Scheduler const& scheduler = thread->pool->scheduler;
+    if (scheduler.queues == kCpuQueues) {
+        if (scheduler.wake == kWakeOneWorker) {
+            _PushTaskWith<CpuQueues, WakeOne>(thread, task);
+        } else {
+            _PushTaskWith<CpuQueues, WakeAll>(thread, task);
         }
-        task = _GetTask(&pool->threads[_thread_id]);
+    } else if (scheduler.wake == kWakeOneWorker) {
+        _PushTaskWith<OwnQueues, WakeOne>(thread, task);
+    } else {
+        _PushTaskWith<OwnQueues, WakeAll>(thread, task);
+    }
+}
+
+Task* _PopCpuTask(TaskPool* pool)
+{
+    CpuQueue* cpu_queue = _AcquireCpuQueue(pool);
+    if (cpu_queue == nullptr) {
+        return nullptr;
+    }
+    Task* task = cpu_queue->queue.pop();
+    _ReleaseCpuQueue(cpu_queue);
+    return task;
+}
+
+/* moves a batch of injected tasks into the thread's own queue, where the
+ * other threads can steal them */
+Task* _GetInjectedTask(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    InjectedTask injected[kInjectBatchSize];
+    int const count = pool->inject_queue.pop_batch(injected, kInjectBatchSize);
+    if (count == 0) {
+        return nullptr;
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        Task* task = _AllocateTask(thread);
+        task->completion = injected[ii].completion;
+        task->cancellation = injected[ii].cancellation;
+        task->function = injected[ii].function;
+        task->user_data = injected[ii].user_data;
+        // the queue was empty before, so this can't overflow
+        thread->queue.push(task);
     }
+    if (count > 1) {
+        _NotifyWorkers(pool);
+    }
+    return thread->queue.pop();
 }
 
+/* moves the oldest spilled task into the thread's task storage. Leaves it
+ * to other threads when the storage is full */
+Task* _GetSpilledTask(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    if (pool->num_spilled.load(std::memory_order_relaxed) == 0) {
+        return nullptr;
+    }
+    Task* task = _TryAllocateTask(thread);
+    if (task == nullptr) {
+        return nullptr;
+    }
+    SpilledTask* spilled = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(pool->spill_mutex);
+        spilled = pool->spill_head;
+        if (spilled == nullptr) {
+            _ReleaseTask(pool, task);
+            return nullptr;
+        }
+        pool->spill_head = spilled->next;
+        if (pool->spill_head == nullptr) {
+            pool->spill_tail = nullptr;
+        }
+        pool->num_spilled--;
+    }
+    task->completion = spilled->task.completion;
+    task->cancellation = spilled->task.cancellation;
+    task->function = spilled->task.function;
+    task->user_data = spilled->task.user_data;
+    pool->allocator.free_function(spilled, pool->allocator.user_data);
+    return task;
+}
+
+uint64_t _GetTimeUs(void)
+{
+    auto const now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+/* returns the timer to the free list, called with the timer mutex held */
+void _FreeTimer(TaskPool* pool, Timer* timer)
+{
+    timer->function = nullptr;
+    timer->next = pool->free_timers;
+    pool->free_timers = timer;
+}
+
+/* spawns the expired timers into the thread's own queue. A one-shot timer
+ * hands the counts it holds over to its task. Timers that don't fit into the
+ * queue stay in the wheel until the next tick so the thread can't run out of
+ * task storage */
+Task* _GetTimerTask(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    uint64_t const next_tick = pool->next_timer_tick.load(std::memory_order_relaxed);
+    if (next_tick == TimerWheel<Timer>::kNoDeadline) {
+        return nullptr;
+    }
+    uint64_t const now_tick = _GetTimeUs() / kMicrosecondsPerTick;
+    if (now_tick < next_tick) {
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> lock(pool->timer_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return nullptr; // another thread is advancing the wheel
+    }
+    Timer* timer = pool->timers.advance(now_tick);
+    int64_t room = kMaxTasks / 2 - thread->queue.size();
+    int num_spawned = 0;
+    while (timer) {
+        Timer* const next = timer->next;
+        if (room <= 0) {
+            pool->timers.insert(timer);
+        } else if (timer->period != 0 && *timer->cancellation != 0) {
+            if (timer->completion) {
+                _ReleaseCompletion(pool, timer->completion);
+            }
+            _FreeTimer(pool, timer);
+        } else {
+            if (timer->period != 0) {
+                if (timer->completion) {
+                    _AcquireCompletion(pool, timer->completion);
+                }
+                _CountSpawned(thread);
+            }
+            Task* task = _AllocateTask(thread);
+            task->completion = timer->completion;
+            task->cancellation = timer->cancellation;
+            task->function = timer->function;
+            task->user_data = timer->user_data;
+            thread->queue.push(task);
+            --room;
+            ++num_spawned;
+            if (timer->period != 0) {
+                timer->deadline += timer->period;
+                pool->timers.insert(timer);
+            } else {
+                _FreeTimer(pool, timer);
+            }
+        }
+        timer = next;
+    }
+    pool->next_timer_tick.store(pool->timers.next_deadline());
+    lock.unlock();
+    if (num_spawned > 1) {
+        _NotifyWorkers(pool);
+    }
+    return thread->queue.pop();
+}
+
+/* runs the function of a finished read and recycles the request */
+void _RunIoRequest(int thread_id, void* data)
+{
+    IoRequest* request = (IoRequest*)data;
+    AsyncIo& io = request->pool->io;
+    request->function(thread_id, request->user_data, request->result);
+    std::lock_guard<std::mutex> lock(io.mutex);
+    request->next = io.free_requests;
+    io.free_requests = request;
+}
+
+/* submits the reads queued so far in one go and spawns the finished ones into
+ * the thread's own queue. Like timers, a request hands the counts it holds
+ * over to its task */
+Task* _GetIoTask(Thread* thread)
+{
+#if defined(TP_HAVE_IO_URING)
+    TaskPool* pool = thread->pool;
+    AsyncIo& io = pool->io;
+    if (!io.started.load(std::memory_order_acquire) || !io.use_ring) {
+        return nullptr;
+    }
+    if (io.pending.load(std::memory_order_relaxed) != 0) {
+        std::unique_lock<std::mutex> lock(io.mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            io.ring.submit();
+            io.pending.store((int)io.ring.pending());
+        }
+    }
+    if (io.in_flight.load(std::memory_order_relaxed) == 0) {
+        return nullptr;
+    }
+    int64_t const room = kMaxTasks / 2 - thread->queue.size();
+    std::unique_lock<std::mutex> lock(io.reap_mutex, std::try_to_lock);
+    if (room <= 0 || !lock.owns_lock()) {
+        return nullptr;
+    }
+    int const max_count = room < kIoBatchSize ? (int)room : kIoBatchSize;
+    int num_spawned = 0;
+    io.ring.reap([thread, &num_spawned](uint64_t user_data, int result) {
+        IoRequest* request = (IoRequest*)(uintptr_t)user_data;
+        if (request == nullptr) {
+            return; // the helper thread's wake-up
+        }
+        request->result = result;
+        Task* task = _AllocateTask(thread);
+        task->completion = request->completion;
+        task->cancellation = nullptr;
+        task->function = _RunIoRequest;
+        task->user_data = request;
+        thread->queue.push(task);
+        ++num_spawned;
+    }, max_count);
+    lock.unlock();
+    io.in_flight -= num_spawned;
+    if (num_spawned > 1) {
+        _NotifyWorkers(pool);
+    }
+    return thread->queue.pop();
+#else
+    (void)thread;
+    return nullptr;
+#endif
+}
+
+/* the next task for the thread: its own newest one, then the timers, I/O,
+ * injected and spilled tasks, then the oldest one of another thread in the
+ * order of the victim policy */
+template<typename Queue, typename Victims>
+Task* _GetTaskWith(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    Task* task = thread->queue.pop();
+    if (task == nullptr && Queue::kUseCpuQueues) {
+        task = _PopCpuTask(pool);
+    }
+    if (task == nullptr) {
+        task = _GetTimerTask(thread);
+    }
+    if (task == nullptr) {
+        task = _GetIoTask(thread);
+    }
+    if (task == nullptr) {
+        task = _GetInjectedTask(thread);
+    }
+    if (task == nullptr) {
+        task = _GetSpilledTask(thread);
+    }
+    if (task == nullptr) {
+        for (int ii = 0; ii < pool->num_slots - 1; ++ii) {
+            int const other_thread_id = Victims::victim(
+                thread->scheduler_context, thread->thread_id, pool->num_slots, ii);
+            if (other_thread_id == thread->thread_id) {
+                continue;
+            }
+            assert(other_thread_id >= 0);
+            assert(other_thread_id < pool->num_slots);
+            auto& other_queue = pool->threads[other_thread_id].queue;
+
+            task = other_queue.steal();
+            if (task) {
+                pool->threads[other_thread_id].last_thief.store(thread->thread_id, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        for (int ii = 0; Queue::kUseCpuQueues && ii < pool->num_cpu_queues; ++ii) {
+            task = pool->cpu_queues[ii].queue.steal();
+            if (task) {
+                return task;
+            }
+        }
+    }
+    return task;
+}
+template<typename Queue>
+Task* _GetTaskFrom(Thread* thread, VictimKind victims)
+{
+    switch (victims) {
+    case kRandomVictims:
+        return _GetTaskWith<Queue, RandomVictims>(thread);
+    case kCallbackVictims:
+        return _GetTaskWith<Queue, CallbackVictims>(thread);
+    default:
+        return _GetTaskWith<Queue, RoundRobinVictims>(thread);
+    }
+}
+Task* _GetTask(Thread* thread)
+{
+    Scheduler const& scheduler = thread->pool->scheduler;
+    if (scheduler.queues == kCpuQueues) {
+        return _GetTaskFrom<CpuQueues>(thread, scheduler.victims);
+    }
+    return _GetTaskFrom<OwnQueues>(thread, scheduler.victims);
+}
+
+/* looks for a task counted in completion: at the bottom of the thread's own
+ * queue, then at the top of every queue, the thread's own included */
+Task* _GetTaskFor(Thread* thread, TaskCompletion const* completion)
+{
+    TaskPool* pool = thread->pool;
+    Task* task = thread->queue.pop();
+    if (task) {
+        if (task->completion == completion) {
+            return task;
+        }
+        thread->queue.push(task); // put back where it was
+    }
+    auto const matches = [completion](Task const* candidate) {
+        return candidate->completion == completion;
+    };
+    for (int ii = 0; ii < pool->num_slots; ++ii) {
+        int const other_thread_id = (thread->thread_id + ii) % pool->num_slots;
+        task = pool->threads[other_thread_id].queue.steal_if(matches);
+        if (task && ii == 0) {
+            return task;
+        } else if (task) {
+            pool->threads[other_thread_id].last_thief.store(thread->thread_id, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    for (int ii = 0; ii < pool->num_cpu_queues; ++ii) {
+        task = pool->cpu_queues[ii].queue.steal_if(matches);
+        if (task) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+/* leapfrogging: the thread that last stole from this one most likely runs
+ * one of the tasks the caller waits for, and whatever it spawned since sits in
+ * its queue */
+Task* _StealFromThief(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    int const thief_id = thread->last_thief.load(std::memory_order_relaxed);
+    if (thief_id < 0 || thief_id == thread->thread_id) {
+        return nullptr;
+    }
+    Thread* thief = &pool->threads[thief_id];
+    Task* task = thief->queue.steal();
+    if (task) {
+        thief->last_thief.store(thread->thread_id, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+void _RunTask(Thread* thread, Task* task)
+{
+    TaskPool* pool = thread->pool;
+    TaskCancellation const* const cancellation = task->cancellation;
+    if (cancellation == nullptr || *cancellation == 0) {
+        // tasks can nest through tpWaitForCompletion
+        TaskCancellation const* const outer_cancellation = _current_cancellation;
+        _current_cancellation = cancellation;
+        task->function(thread->thread_id, task->user_data);
+        _current_cancellation = outer_cancellation;
+    } else if (task->completion) {
+        _SkipTask(thread->thread_id, task->completion, task->user_data);
+    }
+    _CountFinished(thread);
+    if (task->completion) {
+        _ReleaseCompletion(pool, task->completion);
+    }
+    _ReleaseTask(pool, task);
+}
+
+/* worker ids run from 1 to num_threads-1, the lowest ones stay active. The
+ * spare workers after them stand in for blocked threads, one spare each */
+bool _IsWorkerActive(TaskPool const* pool, int thread_id)
+{
+    if (thread_id < pool->num_threads) {
+        return thread_id <= pool->num_active_workers.load();
+    }
+    return thread_id - pool->num_threads < pool->num_blocking_threads.load();
+}
+
+void _ParkWorker(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    // finish our own work before parking so nothing waits on a parked worker
+    Task* task = thread->queue.pop();
+    while (task != nullptr) {
+        _RunTask(thread, task);
+        task = thread->queue.pop();
+    }
+    std::unique_lock<std::mutex> lock(pool->wake_mutex);
+    while (pool->running.load() && !_IsWorkerActive(pool, thread->thread_id)) {
+        pool->park_condition.wait(lock);
+    }
+}
+
+/* called with the wake mutex held after a worker idled for the auto-scale
+ * timeout. Only the highest active worker parks so the active set stays
+ * contiguous */
+void _ShrinkIdleWorkers(TaskPool* pool, int thread_id)
+{
+    int active = thread_id;
+    if (thread_id < pool->num_threads && active > pool->auto_scale_min.load()) {
+        pool->num_active_workers.compare_exchange_strong(active, active - 1);
+    }
+}
+
+void _GrowBusyWorkers(TaskPool* pool, int64_t queue_depth)
+{
+    int const depth_threshold = pool->auto_scale_depth.load(std::memory_order_relaxed);
+    if (depth_threshold <= 0 || queue_depth < depth_threshold) {
+        return;
+    }
+    if (pool->num_idle_threads.load() != 0) {
+        return;
+    }
+    int active = pool->num_active_workers.load();
+    if (active >= pool->auto_scale_max.load()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(pool->wake_mutex);
+    if (pool->num_active_workers.compare_exchange_strong(active, active + 1)) {
+        pool->park_condition.notify_all();
+    }
+}
+
+/* sleeps until the worker is woken, the next timer is due or the auto-scale
+ * idle timeout passes. Returns true only if the idle timeout passed */
+bool _WaitForWork(TaskPool* pool, std::unique_lock<std::mutex>& lock)
+{
+    if (pool->io.pending.load() != 0 || pool->inject_queue.size() != 0) {
+        return false; // reads are waiting to be submitted, or tasks to be run
+    }
+    if (pool->reactor.num_armed.load() != 0 && !pool->reactor.polling.load()) {
+        return false; // nobody is waiting for the watched fds
+    }
+    int const idle_ms = pool->auto_scale_idle_ms.load();
+    uint64_t const timer_tick = pool->next_timer_tick.load();
+    if (timer_tick == TimerWheel<Timer>::kNoDeadline) {
+        if (idle_ms > 0) {
+            auto const timeout = std::chrono::milliseconds(idle_ms);
+            return pool->wake_condition.wait_for(lock, timeout) == std::cv_status::timeout;
+        }
+        pool->wake_condition.wait(lock);
+        return false;
+    }
+    std::chrono::steady_clock::time_point const timer_time(
+        std::chrono::microseconds(timer_tick * kMicrosecondsPerTick));
+    if (idle_ms > 0) {
+        auto const idle_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(idle_ms);
+        if (idle_time < timer_time) {
+            return pool->wake_condition.wait_until(lock, idle_time) == std::cv_status::timeout;
+        }
+    }
+    pool->wake_condition.wait_until(lock, timer_time);
+    return false;
+}
+
+#if defined(TP_HAVE_EPOLL)
+enum : uint64_t {
+    kWakeEvent = ~0ull,
+};
+
+void _RunWatchEvent(int thread_id, void* data)
+{
+    WatchEvent* event = (WatchEvent*)data;
+    Reactor& reactor = event->pool->reactor;
+    event->function(thread_id, event->user_data, event->events);
+    std::lock_guard<std::mutex> lock(reactor.mutex);
+    event->next = reactor.free_events;
+    reactor.free_events = event;
+}
+
+/* spawns the watches that fired into the thread's own queue */
+int _DispatchFdEvents(Thread* thread, epoll_event const* events, int count)
+{
+    TaskPool* pool = thread->pool;
+    Reactor& reactor = pool->reactor;
+    int num_spawned = 0;
+    std::lock_guard<std::mutex> lock(reactor.mutex);
+    for (int ii = 0; ii < count; ++ii) {
+        uint64_t const key = events[ii].data.u64;
+        int const fd = (int)(uint32_t)key;
+        if (fd >= reactor.num_watches) {
+            continue;
+        }
+        FdWatch& watch = reactor.watches[fd];
+        if (!watch.armed || watch.generation != (uint32_t)(key >> 32)) {
+            continue;
+        }
+        watch.armed = false;
+        reactor.num_armed--;
+
+        WatchEvent* event = reactor.free_events;
+        if (event) {
+            reactor.free_events = event->next;
+        } else {
+            event = (WatchEvent*)pool->allocator.allocate_function(sizeof(WatchEvent), pool->allocator.user_data);
+            assert(event != nullptr);
+            event->next_allocated = reactor.allocated_events;
+            reactor.allocated_events = event;
+        }
+        uint32_t const flags = events[ii].events;
+        event->pool = pool;
+        event->function = watch.function;
+        event->user_data = watch.user_data;
+        event->events = ((flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) ? kWatchRead : 0) |
+                        ((flags & EPOLLOUT) ? kWatchWrite : 0) |
+                        ((flags & EPOLLERR) ? kWatchError : 0);
+
+        _CountSpawned(thread);
+        Task* task = _AllocateTask(thread);
+        task->completion = nullptr;
+        task->cancellation = nullptr;
+        task->function = _RunWatchEvent;
+        task->user_data = event;
+        thread->queue.push(task);
+        ++num_spawned;
+    }
+    return num_spawned;
+}
+
+/* checks the watched fds, waiting up to timeout_ms for one to become ready */
+int _PollFds(Thread* thread, int timeout_ms)
+{
+    TaskPool* pool = thread->pool;
+    Reactor& reactor = pool->reactor;
+    if (!reactor.started.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    int64_t const room = kMaxTasks / 2 - thread->queue.size();
+    if (room <= 0) {
+        return 0;
+    }
+    epoll_event events[kMaxFdEvents];
+    int const max_count = room < kMaxFdEvents ? (int)room : kMaxFdEvents;
+    int const count = epoll_wait(reactor.epoll_fd, events, max_count, timeout_ms);
+    if (count <= 0) {
+        return 0;
+    }
+    int const num_spawned = _DispatchFdEvents(thread, events, count);
+    if (num_spawned > 1) {
+        _NotifyWorkers(pool);
+    }
+    return num_spawned;
+}
+
+bool _HasQueuedWork(TaskPool const* pool)
+{
+    if (pool->inject_queue.size() != 0 || pool->io.pending.load() != 0) {
+        return true;
+    }
+    for (int ii = 0; ii < pool->num_slots; ++ii) {
+        if (pool->threads[ii].queue.size() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* an idle worker looks at the watched fds before it sleeps. If no other
+ * worker holds the polling role, it takes it and sleeps in epoll_wait instead
+ * of on the wake condition, until an fd is ready, the next timer is due or
+ * _NotifyWorkers writes to the eventfd.
+ * Returns true if the worker found events or polled, false if it should sleep
+ * on the wake condition instead */
+bool _PollIdleFds(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    Reactor& reactor = pool->reactor;
+    if (reactor.num_armed.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    if (_PollFds(thread, 0) > 0) {
+        return true;
+    }
+    bool polling = false;
+    if (!reactor.polling.compare_exchange_strong(polling, true)) {
+        return false;
+    }
+    reactor.poller_asleep.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pool->running.load() && _IsWorkerActive(pool, thread->thread_id) && !_HasQueuedWork(pool)) {
+        int timeout_ms = -1;
+        uint64_t const timer_tick = pool->next_timer_tick.load();
+        if (timer_tick != TimerWheel<Timer>::kNoDeadline) {
+            uint64_t const now_tick = _GetTimeUs() / kMicrosecondsPerTick;
+            uint64_t const wait_ms = timer_tick > now_tick ? timer_tick - now_tick : 0;
+            timeout_ms = wait_ms < (uint64_t)INT_MAX ? (int)wait_ms : INT_MAX;
+        }
+        pool->num_idle_threads++;
+        epoll_event events[2];
+        int const count = epoll_wait(reactor.wait_fd, events, 2, timeout_ms);
+        for (int ii = 0; ii < count; ++ii) {
+            if (events[ii].data.u64 == kWakeEvent) {
+                uint64_t value = 0;
+                ssize_t const num_read = read(reactor.wake_fd, &value, sizeof(value));
+                (void)num_read;
+            }
+        }
+        pool->num_idle_threads--;
+        _PollFds(thread, 0);
+    }
+    reactor.poller_asleep.store(false);
+    reactor.polling.store(false);
+    if (reactor.num_armed.load() != 0 && pool->num_idle_threads.load() != 0) {
+        // hand the polling role over while this worker is busy
+        std::lock_guard<std::mutex> lock(pool->wake_mutex);
+        pool->wake_condition.notify_one();
+    }
+    return true;
+}
+#else
+int _PollFds(Thread*, int)
+{
+    return 0;
+}
+bool _PollIdleFds(Thread*)
+{
+    return false;
+}
+#endif // defined(TP_HAVE_EPOLL)
+
+/* the worker loop, which runs every scheduling decision of Policy without an
+ * indirect call */
+template<typename Policy>
+void _ThreadProcWith(Thread* thread)
+{
+    assert(thread != nullptr);
+    assert(thread->pool != nullptr);
+    TaskPool* pool = thread->pool;
+    _SetThreadId(pool, thread->thread_id);
+    pool->num_started_threads++;
+    int idle_rounds = 0;
+    do {
+        if (!_IsWorkerActive(pool, thread->thread_id)) {
+            // look for work right away once reactivated
+            _ParkWorker(thread);
+        } else if (Policy::IdlePolicy::keep_looking(thread->scheduler_context, thread->thread_id,
+                                                    idle_rounds++)) {
+            // look again without sleeping
+        } else if (!_PollIdleFds(thread)) {
+            // sleep
+            std::unique_lock<std::mutex> lock(pool->wake_mutex);
+            if (pool->running.load() == false) {
+                break;
+            }
+            pool->num_idle_threads++;
+            if (_WaitForWork(pool, lock)) {
+                _ShrinkIdleWorkers(pool, thread->thread_id);
+            }
+            pool->num_idle_threads--;
+        }
+        if (pool->running.load() == false) {
+            break;
+        }
+        Task* task = _GetTaskWith<typename Policy::QueuePolicy, typename Policy::VictimPolicy>(thread);
+        if (task != nullptr) {
+            idle_rounds = 0;
+        }
+        while (task != nullptr) {
+            _RunTask(thread, task);
+            if (!_IsWorkerActive(pool, thread->thread_id)) {
+                break;
+            }
+            task = _GetTaskWith<typename Policy::QueuePolicy, typename Policy::VictimPolicy>(thread);
+        }
+    } while (pool->running.load());
+}
+
+/* picks the worker loop for the pool's policies, one policy kind at a time */
+typedef void ThreadProc(Thread* thread);
+template<typename Queue, typename Victims, typename Idle>
+ThreadProc* _SelectWakePolicy(Scheduler const& scheduler)
+{
+    if (scheduler.wake == kWakeOneWorker) {
+        return &_ThreadProcWith<SchedulerPolicy<Queue, Victims, Idle, WakeOne> >;
+    }
+    return &_ThreadProcWith<SchedulerPolicy<Queue, Victims, Idle, WakeAll> >;
+}
+template<typename Queue, typename Victims>
+ThreadProc* _SelectIdlePolicy(Scheduler const& scheduler)
+{
+    switch (scheduler.idle) {
+    case kSpinWhenIdle:
+        return _SelectWakePolicy<Queue, Victims, SpinWhenIdle>(scheduler);
+    case kCallbackIdle:
+        return _SelectWakePolicy<Queue, Victims, CallbackIdle>(scheduler);
+    default:
+        return _SelectWakePolicy<Queue, Victims, SleepWhenIdle>(scheduler);
+    }
+}
+template<typename Queue>
+ThreadProc* _SelectVictimPolicy(Scheduler const& scheduler)
+{
+    switch (scheduler.victims) {
+    case kRandomVictims:
+        return _SelectIdlePolicy<Queue, RandomVictims>(scheduler);
+    case kCallbackVictims:
+        return _SelectIdlePolicy<Queue, CallbackVictims>(scheduler);
+    default:
+        return _SelectIdlePolicy<Queue, RoundRobinVictims>(scheduler);
+    }
+}
+Scheduler _SelectScheduler(TaskPool const* pool, TaskPoolCreateInfo const* info)
+{
+    SchedulerCallbacks const& callbacks = pool->scheduler_callbacks;
+    Scheduler scheduler;
+    scheduler.queues = pool->num_cpu_queues != 0 ? kCpuQueues : kOwnQueues;
+    scheduler.victims = callbacks.select_victim ? kCallbackVictims :
+                        info->victim_policy == kVictimRandom ? kRandomVictims : kRoundRobinVictims;
+    scheduler.idle = callbacks.keep_spinning ? kCallbackIdle :
+                     info->idle_policy == kIdleSpin ? kSpinWhenIdle : kSleepWhenIdle;
+    scheduler.wake = info->wake_policy == kWakeOne ? kWakeOneWorker : kWakeAllWorkers;
+    if (scheduler.queues == kCpuQueues) {
+        scheduler.thread_proc = _SelectVictimPolicy<CpuQueues>(scheduler);
+    } else {
+        scheduler.thread_proc = _SelectVictimPolicy<OwnQueues>(scheduler);
+    }
+    return scheduler;
+}
+
+void _PushInjectedTask(TaskPool* pool, InjectedTask const& task)
+{
+    while (pool->inject_queue.push(task) != 0) {
+        // full, wait for the workers to make room
+        _NotifyWorkers(pool);
+        std::this_thread::yield();
+    }
+}
+
+/* splitmix64 */
+uint64_t _NextRandom(uint64_t* state)
+{
+    uint64_t value = (*state += 0x9e3779b97f4a7c15ull);
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+void _SpawnSeededTask(TaskPool* pool, TaskFunction* function, void* data,
+                      TaskCompletion* completion, TaskCancellation const* cancellation)
+{
+    SeededScheduler& seeded = pool->seeded;
+    if (completion) {
+        _AcquireCompletion(pool, completion);
+    }
+    _CountSpawned(pool);
+    std::lock_guard<std::mutex> lock(seeded.mutex);
+    if (seeded.num_tasks == seeded.max_tasks) {
+        int const max_tasks = seeded.max_tasks > 0 ? seeded.max_tasks * 2 : kMaxTasks;
+        SeededTask* tasks = (SeededTask*)pool->allocator.allocate_function(
+            sizeof(SeededTask) * max_tasks, pool->allocator.user_data);
+        assert(tasks != nullptr);
+        if (seeded.tasks) {
+            memcpy(tasks, seeded.tasks, sizeof(SeededTask) * seeded.num_tasks);
+            pool->allocator.free_function(seeded.tasks, pool->allocator.user_data);
+        }
+        seeded.tasks = tasks;
+        seeded.max_tasks = max_tasks;
+    }
+    SeededTask const task = { function, data, completion, cancellation };
+    seeded.tasks[seeded.num_tasks++] = task;
+    seeded.condition.notify_all();
+}
+
+/* true if the calling thread may run seeded tasks: the worker whose turn it
+ * is runs a task, and while that task waits it runs the others on its stack.
+ * Other threads only wait, so they can't change the order, unless the pool
+ * has no workers at all */
+bool _RunsSeededTasks(TaskPool const* pool)
+{
+    return _seeded_depth > 0 || pool->num_threads == 1;
+}
+
+/* hands the next turn to a worker picked by the seeded generator */
+void _PassSeededTurn(TaskPool* pool)
+{
+    SeededScheduler& seeded = pool->seeded;
+    std::lock_guard<std::mutex> lock(seeded.mutex);
+    seeded.turn = 1 + (int)(_NextRandom(&seeded.random_state) % (uint64_t)(pool->num_threads - 1));
+    seeded.condition.notify_all();
+}
+
+/* runs a timed or I/O task, or any other task from the thread's queue, as
+ * part of the seeded schedule */
+bool _RunSeededFallbackTask(TaskPool* pool)
+{
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        return false;
+    }
+    std::lock_guard<std::recursive_mutex> run_lock(pool->seeded.run_mutex);
+    Task* task = _GetTask(&pool->threads[thread_id]);
+    if (task == nullptr) {
+        return false;
+    }
+    _seeded_depth++;
+    _RunTask(&pool->threads[thread_id], task);
+    _seeded_depth--;
+    return true;
+}
+
+/* runs one task picked by the seeded generator on the calling thread, and
+ * passes the turn on once a task that isn't nested in another finished.
+ * Returns false if no task was pending */
+bool _RunSeededTask(TaskPool* pool)
+{
+    SeededScheduler& seeded = pool->seeded;
+    std::lock_guard<std::recursive_mutex> run_lock(seeded.run_mutex);
+    SeededTask task;
+    {
+        std::lock_guard<std::mutex> lock(seeded.mutex);
+        if (seeded.num_tasks == 0) {
+            return false;
+        }
+        uint64_t const random = _NextRandom(&seeded.random_state);
+        int const index = (int)(random % (uint64_t)seeded.num_tasks);
+        task = seeded.tasks[index];
+        seeded.tasks[index] = seeded.tasks[--seeded.num_tasks];
+    }
+    int thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        thread_id = 0; // a thread without a slot in a pool without workers
+    }
+    _seeded_depth++;
+    if (task.cancellation == nullptr || *task.cancellation == 0) {
+        TaskCancellation const* const outer_cancellation = _current_cancellation;
+        _current_cancellation = task.cancellation;
+        task.function(thread_id, task.user_data);
+        _current_cancellation = outer_cancellation;
+    } else if (task.completion) {
+        _SkipTask(thread_id, task.completion, task.user_data);
+    }
+    _seeded_depth--;
+    _CountFinished(pool);
+    if (task.completion) {
+        _ReleaseCompletion(pool, task.completion);
+    }
+    if (_seeded_depth == 0 && pool->num_threads > 1) {
+        _PassSeededTurn(pool);
+    }
+    return true;
+}
+
+/* the worker loop in deterministic mode: run a task whenever it's this
+ * worker's turn. The worker holding the turn also looks for timed tasks and
+ * I/O while no task is pending */
+void _SeededThreadProc(Thread* thread)
+{
+    TaskPool* pool = thread->pool;
+    SeededScheduler& seeded = pool->seeded;
+    _SetThreadId(pool, thread->thread_id);
+    pool->num_started_threads++;
+    std::unique_lock<std::mutex> lock(seeded.mutex);
+    while (pool->running.load()) {
+        if (seeded.turn != thread->thread_id) {
+            seeded.condition.wait(lock);
+            continue;
+        }
+        bool const pending = seeded.num_tasks != 0;
+        lock.unlock();
+        bool const ran = pending ? _RunSeededTask(pool) : _RunSeededFallbackTask(pool);
+        lock.lock();
+        if (!ran && seeded.turn == thread->thread_id && seeded.num_tasks == 0) {
+            seeded.condition.wait_for(lock, std::chrono::microseconds(kMicrosecondsPerTick));
+        }
+    }
+}
+
+/* runs a pending task on behalf of a waiting thread in deterministic mode,
+ * falling back to the calling thread's queue for timed tasks and I/O. Threads
+ * that may not run tasks just wait for the workers */
+void _HelpSeededPool(TaskPool* pool)
+{
+    if (!_RunsSeededTasks(pool) || !(_RunSeededTask(pool) || _RunSeededFallbackTask(pool))) {
+        std::this_thread::yield();
+    }
+}
+
+/* appends to the spill list, or waits for room in the inject queue if the
+ * allocation fails */
+void _SpillTask(TaskPool* pool, InjectedTask const& task)
+{
+    SpilledTask* spilled = (SpilledTask*)pool->allocator.allocate_function(sizeof(SpilledTask),
+                                                                          pool->allocator.user_data);
+    if (spilled == nullptr) {
+        _PushInjectedTask(pool, task);
+        return;
+    }
+    spilled->next = nullptr;
+    spilled->task = task;
+    std::lock_guard<std::mutex> lock(pool->spill_mutex);
+    if (pool->spill_tail) {
+        pool->spill_tail->next = spilled;
+    } else {
+        pool->spill_head = spilled;
+    }
+    pool->spill_tail = spilled;
+    pool->num_spilled++;
+}
+
+/* threads without a slot can't run tasks, so kAdmitInline waits like
+ * kAdmitBlock for them. try_only fails instead of waiting; a push that
+ * loses the race for the last cell spills rather than fail after the
+ * completion was taken */
+int _InjectTask(TaskPool* pool, TaskFunction* function, void* data,
+                TaskCompletion* completion, TaskCancellation const* cancellation,
+                bool try_only)
+{
+    if (pool->deterministic) {
+        _SpawnSeededTask(pool, function, data, completion, cancellation);
+        return 0;
+    }
+    bool const full = _IsPoolFull(pool) || pool->inject_queue.size() >= kMaxInjectedTasks;
+    bool const spill = pool->admission_policy == kAdmitSpill;
+    if (full && try_only) {
+        return -1;
+    }
+    while (full && !spill && _IsPoolFull(pool)) {
+        _NotifyWorkers(pool);
+        std::this_thread::yield();
+    }
+    if (completion) {
+        _AcquireCompletion(pool, completion);
+    }
+    _CountSpawned(pool);
+    InjectedTask const task = { function, data, completion, cancellation };
+    if (!spill && !try_only) {
+        _PushInjectedTask(pool, task);
+    } else if ((full && spill) || pool->inject_queue.push(task) != 0) {
+        _SpillTask(pool, task);
+    }
+    _NotifyWorkers(pool);
+    return 0;
+}
+
+int64_t _ReadBlocking(IoRequest const* request)
+{
+#if defined(_WIN32)
+    HANDLE const file = (HANDLE)_get_osfhandle(request->fd);
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = (DWORD)request->offset;
+    overlapped.OffsetHigh = (DWORD)(request->offset >> 32);
+    DWORD num_read = 0;
+    if (!ReadFile(file, request->buffer, (DWORD)request->size, &num_read, &overlapped)) {
+        DWORD const error = GetLastError();
+        return error == ERROR_HANDLE_EOF ? 0 : -(int64_t)error;
+    }
+    return num_read;
+#else
+    ssize_t result = 0;
+    do {
+        result = pread(request->fd, request->buffer, request->size, (off_t)request->offset);
+    } while (result < 0 && errno == EINTR);
+    return result < 0 ? -errno : result;
+#endif
+}
+
+/* hands finished reads to the workers through the injection queue. The
+ * notification is sent with the wake mutex held, which workers check the
+ * injection queue under before they sleep */
+void _CompleteIoRequests(TaskPool* pool, InjectedTask const* tasks, int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        _PushInjectedTask(pool, tasks[ii]);
+    }
+    std::lock_guard<std::mutex> lock(pool->wake_mutex);
+    _NotifyWorkers(pool);
+}
+
+/* without io_uring, the helper thread performs the reads one by one */
+void _BlockingIoThreadProc(TaskPool* pool)
+{
+    AsyncIo& io = pool->io;
+    std::unique_lock<std::mutex> lock(io.mutex);
+    while (true) {
+        while (io.blocking_head == nullptr && !io.stopping) {
+            io.condition.wait(lock);
+        }
+        IoRequest* request = io.blocking_head;
+        if (request == nullptr) {
+            break;
+        }
+        io.blocking_head = request->next;
+        if (io.blocking_head == nullptr) {
+            io.blocking_tail = nullptr;
+        }
+        lock.unlock();
+        request->result = _ReadBlocking(request);
+        InjectedTask const task = { _RunIoRequest, request, request->completion, nullptr };
+        _CompleteIoRequests(pool, &task, 1);
+        lock.lock();
+    }
+}
+
+#if defined(TP_HAVE_IO_URING)
+/* with io_uring, the helper thread waits on the ring while no pool thread is
+ * around to reap it */
+void _RingIoThreadProc(TaskPool* pool)
+{
+    AsyncIo& io = pool->io;
+    bool stopping = false;
+    while (!stopping) {
+        io.ring.wait();
+        InjectedTask tasks[kIoBatchSize];
+        int count = 0;
+        {
+            std::lock_guard<std::mutex> lock(io.reap_mutex);
+            io.ring.reap([&tasks, &count, &stopping](uint64_t user_data, int result) {
+                IoRequest* request = (IoRequest*)(uintptr_t)user_data;
+                if (request == nullptr) {
+                    stopping = true;
+                    return;
+                }
+                request->result = result;
+                InjectedTask const task = { _RunIoRequest, request, request->completion, nullptr };
+                tasks[count++] = task;
+            }, kIoBatchSize);
+        }
+        if (count > 0) {
+            io.in_flight -= count;
+            _CompleteIoRequests(pool, tasks, count);
+        }
+    }
+}
+#endif
+
+void _StartAsyncIo(TaskPool* pool)
+{
+    AsyncIo& io = pool->io;
+    if (io.started.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(io.mutex);
+    if (io.started.load()) {
+        return;
+    }
+#if defined(TP_HAVE_IO_URING)
+    if (!io.disable_ring && io.ring.create(kIoRingEntries) == 0) {
+        io.use_ring = true;
+        io.thread = std::thread(_RingIoThreadProc, pool);
+    }
+#endif
+    if (!io.use_ring) {
+        io.thread = std::thread(_BlockingIoThreadProc, pool);
+    }
+    io.started.store(true, std::memory_order_release);
+}
+
+/* called once no reads are outstanding */
+void _StopAsyncIo(TaskPool* pool)
+{
+    AsyncIo& io = pool->io;
+    if (!io.started.load()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(io.mutex);
+        io.stopping = true;
+#if defined(TP_HAVE_IO_URING)
+        if (io.use_ring) {
+            io.ring.prepare_nop(0);
+            io.ring.submit();
+        }
+#endif
+        io.condition.notify_all();
+    }
+    io.thread.join();
+#if defined(TP_HAVE_IO_URING)
+    io.ring.destroy();
+#endif
+    IoRequest* request = io.allocated_requests;
+    while (request) {
+        IoRequest* const next = request->next_allocated;
+        pool->allocator.free_function(request, pool->allocator.user_data);
+        request = next;
+    }
+}
+
+/* true if a spawn should run its task on the spot instead of queueing it:
+ * the thread's queue already holds inline_queue_depth tasks and no worker is
+ * idle to take them, so recursive code stops paying for spawns nobody
+ * steals. Up to max_inline_depth inline tasks nest on the stack, past that
+ * they queue. kAdmitInline runs tasks through _RunInline too, regardless */
+bool _ShouldSpawnInline(Thread const* thread)
+{
+    TaskPool const* pool = thread->pool;
+    return thread->inline_depth < pool->max_inline_depth.load(std::memory_order_relaxed) &&
+           thread->queue.size() >= pool->inline_queue_depth.load(std::memory_order_relaxed) &&
+           pool->num_idle_threads.load(std::memory_order_relaxed) == 0;
+}
+void _RunInline(Thread* thread, TaskFunction* function, void* data,
+                TaskCompletion* completion, TaskCancellation const* cancellation)
+{
+    Task task;
+    task.completion = completion;
+    task.cancellation = cancellation;
+    task.function = function;
+    task.user_data = data;
+    thread->inline_depth++;
+    _RunTask(thread, &task);
+    thread->inline_depth--;
+}
+
+/* spawns into the calling thread's queue, unless the task runs inline. When
+ * _AdmitTask finds no room the admission policy decides, or the spawn fails
+ * with -1 for try_only, before the completion is touched. A task that runs
+ * while its thread waits for room runs its own spawns inline if it finds no
+ * room either: waiting again would stack up tasks that hold slots without
+ * ever freeing them */
+int _SpawnTask(TaskPool* pool, TaskFunction* function, void* data,
+               TaskCompletion* completion, TaskCancellation const* cancellation,
+               bool try_only)
+{
+    if (pool->deterministic) {
+        _SpawnSeededTask(pool, function, data, completion, cancellation);
+        return 0;
+    }
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        // no queue of our own to push into
+        return _InjectTask(pool, function, data, completion, cancellation, try_only);
+    }
+    Thread* thread = &pool->threads[thread_id];
+    bool const run_inline = _ShouldSpawnInline(thread);
+    Task* task = run_inline ? nullptr : _AdmitTask(thread);
+    if (task == nullptr && !run_inline) {
+        if (try_only) {
+            return -1;
+        }
+        if (pool->admission_policy == kAdmitBlock && !thread->admitting) {
+            thread->admitting = true;
+            while ((task = _AdmitTask(thread)) == nullptr) {
+                // running a task frees its slot and takes it out of flight
+                Task* other_task = _GetTask(thread);
+                if (other_task) {
+                    _RunTask(thread, other_task);
+                } else {
+                    _NotifyWorkers(pool);
+                    std::this_thread::yield();
+                }
+            }
+            thread->admitting = false;
+        }
+    }
+    if (completion) {
+        _AcquireCompletion(pool, completion);
+    }
+    _CountSpawned(thread);
+    if (task == nullptr && !run_inline && pool->admission_policy == kAdmitSpill) {
+        InjectedTask const spilled = { function, data, completion, cancellation };
+        _SpillTask(pool, spilled);
+        _NotifyWorkers(pool);
+        return 0;
+    } else if (task == nullptr) {
+        _RunInline(thread, function, data, completion, cancellation);
+        return 0;
+    }
+    task->completion = completion;
+    task->cancellation = cancellation;
+    task->function = function;
+    task->user_data = data;
+    _PushTask(thread, task);
+    _GrowBusyWorkers(pool, thread->queue.size());
+    return 0;
+}
+
+/* queues one half of a fork and runs the other on the caller, the child
+ * with kSpawnWorkFirst and the continuation otherwise. Deterministic pools
+ * and threads without a slot queue both, the former to keep the order up to
+ * the seed */
+void _ForkTask(TaskPool* pool, TaskFunction* child, void* child_data,
+               TaskFunction* continuation, void* continuation_data,
+               TaskCompletion* completion, TaskCancellation const* cancellation, int policy)
+{
+    TaskFunction* queued = child;
+    void* queued_data = child_data;
+    TaskFunction* here = continuation;
+    void* here_data = continuation_data;
+    if (policy == kSpawnWorkFirst) {
+        queued = continuation;
+        queued_data = continuation_data;
+        here = child;
+        here_data = child_data;
+    }
+    _SpawnTask(pool, queued, queued_data, completion, cancellation, false);
+    int const thread_id = _ThreadId(pool);
+    if (pool->deterministic || thread_id < 0) {
+        _SpawnTask(pool, here, here_data, completion, cancellation, false);
+        return;
+    }
+    Thread* thread = &pool->threads[thread_id];
+    if (completion) {
+        _AcquireCompletion(pool, completion);
+    }
+    _CountSpawned(thread);
+    _RunInline(thread, here, here_data, completion, cancellation);
+}
+
+void _AddTimer(TaskPool* pool, uint64_t time_us, uint64_t period_us,
+               TaskFunction* function, void* data, TaskCompletion* completion,
+               TaskCancellation const* cancellation)
+{
+    // the wheel takes the counts as soon as the timer is in it
+    if (completion) {
+        _AcquireCompletion(pool, completion);
+    }
+    if (period_us == 0) {
+        _CountSpawned(pool);
+    }
+    bool earlier = false;
+    {
+        std::lock_guard<std::mutex> lock(pool->timer_mutex);
+        Timer* timer = pool->free_timers;
+        if (timer) {
+            pool->free_timers = timer->next;
+        } else {
+            timer = (Timer*)pool->allocator.allocate_function(sizeof(Timer), pool->allocator.user_data);
+            assert(timer != nullptr);
+            timer->next_allocated = pool->allocated_timers;
+            pool->allocated_timers = timer;
+        }
+        timer->next = nullptr;
+        timer->deadline = (time_us + kMicrosecondsPerTick - 1) / kMicrosecondsPerTick;
+        timer->period = (period_us + kMicrosecondsPerTick - 1) / kMicrosecondsPerTick;
+        timer->function = function;
+        timer->user_data = data;
+        timer->completion = completion;
+        timer->cancellation = cancellation;
+        if (pool->timers.size() == 0) {
+            // catch up with the clock in one step instead of tick by tick
+            pool->timers.advance(_GetTimeUs() / kMicrosecondsPerTick);
+        }
+        pool->timers.insert(timer);
+        uint64_t const next_tick = pool->timers.next_deadline();
+        earlier = next_tick < pool->next_timer_tick.load();
+        pool->next_timer_tick.store(next_tick);
+    }
+    if (earlier) {
+        // sleeping workers have to pick up the new deadline
+        std::lock_guard<std::mutex> lock(pool->wake_mutex);
+        _NotifyWorkers(pool);
+    }
+}
+
+#if defined(TP_HAVE_EPOLL)
+int _StartReactor(TaskPool* pool)
+{
+    Reactor& reactor = pool->reactor;
+    if (reactor.started.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epoll_fd < 0) {
+        return -errno;
+    }
+    reactor.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reactor.wake_fd < 0) {
+        int const error = errno;
+        close(reactor.epoll_fd);
+        reactor.epoll_fd = -1;
+        return -error;
+    }
+    reactor.wait_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.wait_fd < 0) {
+        int const error = errno;
+        close(reactor.wake_fd);
+        close(reactor.epoll_fd);
+        reactor.epoll_fd = -1;
+        return -error;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = kWakeEvent;
+    epoll_ctl(reactor.wait_fd, EPOLL_CTL_ADD, reactor.wake_fd, &event);
+    event.data.u64 = 0;
+    epoll_ctl(reactor.wait_fd, EPOLL_CTL_ADD, reactor.epoll_fd, &event);
+    reactor.started.store(true, std::memory_order_release);
+    return 0;
+}
+
+/* called once the workers are gone */
+void _StopReactor(TaskPool* pool)
+{
+    Reactor& reactor = pool->reactor;
+    if (!reactor.started.load()) {
+        return;
+    }
+    close(reactor.wait_fd);
+    close(reactor.wake_fd);
+    close(reactor.epoll_fd);
+    WatchEvent* event = reactor.allocated_events;
+    while (event) {
+        WatchEvent* const next = event->next_allocated;
+        pool->allocator.free_function(event, pool->allocator.user_data);
+        event = next;
+    }
+    if (reactor.watches) {
+        pool->allocator.free_function(reactor.watches, pool->allocator.user_data);
+    }
+}
+
+/* grows the watch table to hold fd, called with the reactor mutex held */
+int _ReserveWatch(TaskPool* pool, int fd)
+{
+    Reactor& reactor = pool->reactor;
+    if (fd < reactor.num_watches) {
+        return 0;
+    }
+    int num_watches = reactor.num_watches > 0 ? reactor.num_watches : 64;
+    while (num_watches <= fd) {
+        num_watches *= 2;
+    }
+    size_t const size = sizeof(FdWatch) * num_watches;
+    FdWatch* watches = (FdWatch*)pool->allocator.allocate_function(size, pool->allocator.user_data);
+    if (watches == nullptr) {
+        return -ENOMEM;
+    }
+    memset(watches, 0, size);
+    if (reactor.watches) {
+        memcpy(watches, reactor.watches, sizeof(FdWatch) * reactor.num_watches);
+        pool->allocator.free_function(reactor.watches, pool->allocator.user_data);
+    }
+    reactor.watches = watches;
+    reactor.num_watches = num_watches;
+    return 0;
+}
+#endif // defined(TP_HAVE_EPOLL)
+
+} // anonymous namespace
+
+/* public methods */
+TaskPool* tpCreatePool(int num_threads, AllocationCallbacks const* allocator)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = num_threads;
+    info.allocator = allocator;
+    return tpCreatePoolWithInfo(&info);
+}
+
+TaskPool* tpCreatePoolWithInfo(TaskPoolCreateInfo const* info)
+{
+    AllocationCallbacks const* allocator = info->allocator;
+    if (allocator == nullptr) {
+        allocator = &kDefaultAllocator;
+    }
+
+    int const num_threads = info->num_threads + 1; // add one for the main thread
+    int const num_spare_threads = info->num_spare_threads > 0 ? info->num_spare_threads : 0;
+    int const num_external_threads = info->max_external_threads > 0 ? info->max_external_threads : 0;
+    int const num_workers = num_threads + num_spare_threads;
+    int const num_slots = num_workers + num_external_threads;
+    size_t const total_size = sizeof(TaskPool) + sizeof(Thread) * (num_slots - 1);
+    void* allocation = nullptr;
+    void* const memory = _AllocateAligned(allocator, total_size, &allocation);
+    if (memory == nullptr) {
+        return nullptr;
+    }
+    TaskPool* pool = new (memory) TaskPool;
+    pool->allocator = *allocator;
+    pool->allocation = allocation;
+    pool->num_threads = num_threads;
+    pool->num_spare_threads = num_spare_threads;
+    pool->num_external_threads = num_external_threads;
+    pool->num_slots = num_slots;
+    pool->num_idle_threads = 0;
+    pool->num_started_threads = 0;
+    pool->num_active_workers = num_threads - 1;
+    pool->io.disable_ring = info->disable_io_uring != 0;
+    pool->deterministic = info->deterministic != 0;
+    pool->seeded.random_state = info->seed;
+    if (num_threads > 1) {
+        pool->seeded.turn = 1 + (int)(_NextRandom(&pool->seeded.random_state) % (uint64_t)(num_threads - 1));
+    }
+    pool->asymmetric_fences = info->asymmetric_fences != 0 && RegisterHeavyFence();
+    pool->admission_policy = info->admission_policy;
+    pool->spawn_policy = info->spawn_policy;
+    pool->max_in_flight = info->max_tasks_in_flight > 0 ? info->max_tasks_in_flight : 0;
+    pool->running.store(true);
+
+    memset((void*)pool->threads, 0, sizeof(pool->threads[0])*num_slots);
+    for (int ii = 0; ii < num_slots; ++ii) {
+        pool->threads[ii].queue.set_asymmetric_fences(pool->asymmetric_fences);
+        pool->threads[ii].last_thief.store(-1, std::memory_order_relaxed);
+    }
+#if defined(TP_HAVE_SCHED_GETCPU)
+    if (info->per_cpu_queues && sched_getcpu() >= 0) {
+        long const num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        pool->num_cpu_queues = num_cpus > 0 ? (int)num_cpus : 1;
+        pool->cpu_queues = (CpuQueue*)_AllocateAligned(allocator, sizeof(CpuQueue) * pool->num_cpu_queues,
+                                                       &pool->cpu_queue_allocation);
+        if (pool->cpu_queues == nullptr) {
+            pool->num_cpu_queues = 0;
+        }
+        for (int ii = 0; ii < pool->num_cpu_queues; ++ii) {
+            new (&pool->cpu_queues[ii]) CpuQueue;
+            pool->cpu_queues[ii].owned.store(false);
+            pool->cpu_queues[ii].queue.set_asymmetric_fences(pool->asymmetric_fences);
+        }
+    }
+#endif
+    if (info->scheduler_callbacks) {
+        pool->scheduler_callbacks = *info->scheduler_callbacks;
+    } else {
+        memset(&pool->scheduler_callbacks, 0, sizeof(pool->scheduler_callbacks));
+    }
+    pool->scheduler = _SelectScheduler(pool, info);
+    for (int ii = 0; ii < num_slots; ++ii) {
+        SchedulerContext& context = pool->threads[ii].scheduler_context;
+        context.random_state = 0x9e3779b97f4a7c15ull * (uint64_t)(ii + 1);
+        context.callbacks = &pool->scheduler_callbacks;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    pool->serial = _next_pool_serial++;
+    pool->threads[0].thread_id = 0;
+    pool->threads[0].pool = pool;
+    _SetThreadId(pool, 0);
+    for (int ii = 1; ii < pool->num_slots; ++ii) {
+        pool->threads[ii].thread_id = ii;
+        pool->threads[ii].pool = pool;
+        assert(pool->threads[ii].pool);
+        if (ii < num_workers) {
+            pool->threads[ii].thread = std::thread(pool->deterministic ? _SeededThreadProc :
+                                                   pool->scheduler.thread_proc, &pool->threads[ii]);
+        }
+    }
+    if (pool->deterministic || pool->scheduler.idle == kCallbackIdle) {
+        // seeded workers don't idle, and keep_spinning may never let the
+        // workers idle
+        while (pool->num_started_threads.load() != num_workers - 1) {
+            std::this_thread::yield();
+        }
+    } else {
+        while(!pool->deterministic && pool->num_idle_threads.load() != num_threads-1)
+            ; // wait for all threads to idle
+    }
+
+    return pool;
+}
+
+void tpDestroyPool(TaskPool* pool)
+{
+    tpFinishAllWork(pool);
+    {
+        std::lock_guard<std::mutex> lock(pool->wake_mutex);
+        pool->running.store(false);
+        _NotifyWorkers(pool);
+        pool->park_condition.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool->seeded.mutex);
+        pool->seeded.condition.notify_all();
+    }
+    for (int ii = 1; ii < pool->num_slots - pool->num_external_threads; ++ii) {
+        pool->threads[ii].thread.join();
+    }
+    _StopAsyncIo(pool);
+    for (int ii = 0; ii < kMaxCompletionEvents; ++ii) {
+        if (pool->completion_events[ii].completion.load()) {
+            tpDestroyCompletionEvent(pool, (TaskCompletion*)pool->completion_events[ii].completion.load());
+        }
+    }
+#if defined(TP_HAVE_EPOLL)
+    _StopReactor(pool);
+#endif
+    SpilledTask* spilled = pool->spill_head;
+    while (spilled) {
+        SpilledTask* const next = spilled->next;
+        pool->allocator.free_function(spilled, pool->allocator.user_data);
+        spilled = next;
+    }
+    Timer* timer = pool->allocated_timers;
+    while (timer) {
+        Timer* const next = timer->next_allocated;
+        pool->allocator.free_function(timer, pool->allocator.user_data);
+        timer = next;
+    }
+    if (pool->seeded.tasks) {
+        pool->allocator.free_function(pool->seeded.tasks, pool->allocator.user_data);
+    }
+    if (pool->cpu_queues) {
+        pool->allocator.free_function(pool->cpu_queue_allocation, pool->allocator.user_data);
+    }
+    _ClearThreadId(pool);
+    pool->allocator.free_function(pool->allocation, pool->allocator.user_data);
+}
+
+int tpNumThreads(TaskPool const* pool)
+{
+    if (pool == nullptr) {
+        return 0;
+    }
+    return pool->num_threads;
+}
+
+AllocationCallbacks const* tpGetAllocator(TaskPool const* pool)
+{
+    return &pool->allocator;
+}
+
+int tpNumIdleThreads(TaskPool const* pool)
+{
+    if (pool == nullptr) {
+        return 0;
+    }
+    return pool->num_idle_threads;
+}
+
+void tpSetActiveWorkers(TaskPool* pool, int num_workers)
+{
+    if (num_workers < 0) {
+        num_workers = 0;
+    } else if (num_workers > pool->num_threads - 1) {
+        num_workers = pool->num_threads - 1;
+    }
+    std::lock_guard<std::mutex> lock(pool->wake_mutex);
+    pool->num_active_workers.store(num_workers);
+    // wake parked workers that became active and idle ones that should park
+    pool->park_condition.notify_all();
+    _NotifyWorkers(pool);
+}
+
+int tpNumActiveWorkers(TaskPool const* pool)
+{
+    if (pool == nullptr) {
+        return 0;
+    }
+    return pool->num_active_workers;
+}
+
+void tpSetAutoScale(TaskPool* pool, AutoScaleInfo const* info)
+{
+    std::lock_guard<std::mutex> lock(pool->wake_mutex);
+    if (info == nullptr) {
+        pool->auto_scale_depth.store(0);
+        pool->auto_scale_idle_ms.store(0);
+        return;
+    }
+    int const max_workers = pool->num_threads - 1;
+    int const max_active = info->max_workers < max_workers ? info->max_workers : max_workers;
+    int const min_active = info->min_workers < max_active ? info->min_workers : max_active;
+    pool->auto_scale_min.store(min_active > 0 ? min_active : 0);
+    pool->auto_scale_max.store(max_active > 0 ? max_active : 0);
+    pool->auto_scale_depth.store(info->queue_depth_threshold);
+    pool->auto_scale_idle_ms.store(info->idle_timeout_ms);
+
+    int const active = pool->num_active_workers.load();
+    if (active > pool->auto_scale_max.load()) {
+        pool->num_active_workers.store(pool->auto_scale_max.load());
+    } else if (active < pool->auto_scale_min.load()) {
+        pool->num_active_workers.store(pool->auto_scale_min.load());
+    }
+    // restart the idle timeouts of the sleeping workers
+    pool->park_condition.notify_all();
+    _NotifyWorkers(pool);
+}
+
+void tpSetInlineSpawn(TaskPool* pool, InlineSpawnInfo const* info)
+{
+    if (info == nullptr || info->max_inline_depth <= 0) {
+        pool->max_inline_depth.store(0);
+        return;
+    }
+    pool->inline_queue_depth.store(info->queue_depth_threshold > 0 ? info->queue_depth_threshold : 0);
+    pool->max_inline_depth.store(info->max_inline_depth);
+}
+
+int tpNumSpareThreads(TaskPool const* pool)
+{
+    if (pool == nullptr) {
+        return 0;
+    }
+    return pool->num_spare_threads;
+}
+
+int tpNumCpuQueues(TaskPool const* pool)
+{
+    if (pool == nullptr) {
+        return 0;
+    }
+    return pool->num_cpu_queues;
+}
+
+int tpUsesAsymmetricFences(TaskPool const* pool)
+{
+    if (pool == nullptr) {
+        return 0;
+    }
+    return pool->asymmetric_fences ? 1 : 0;
+}
+
+void tpBeginBlocking(TaskPool* pool)
+{
+    int const num_blocking = ++pool->num_blocking_threads;
+    if (num_blocking <= pool->num_spare_threads) {
+        std::lock_guard<std::mutex> lock(pool->wake_mutex);
+        pool->park_condition.notify_all();
+    }
+}
+
+void tpEndBlocking(TaskPool* pool)
+{
+    // the spare standing in for us parks after its current task
+    int const num_blocking = --pool->num_blocking_threads;
+    assert(num_blocking >= 0);
+    (void)num_blocking;
+}
+
+int tpRegisterThread(TaskPool* pool)
+{
+    if (_ThreadId(pool) >= 0) {
+        return -1; // registered already, or one of the pool's own threads
+    }
+    int const first_external = pool->num_slots - pool->num_external_threads;
+    for (int ii = first_external; ii < pool->num_slots; ++ii) {
+        Thread& thread = pool->threads[ii];
+        bool registered = false;
+        if (thread.registered.compare_exchange_strong(registered, true)) {
+            _SetThreadId(pool, thread.thread_id);
+            return thread.thread_id;
+        }
+    }
+    return -1;
+}
+
+void tpUnregisterThread(TaskPool* pool)
+{
+    int const thread_id = _ThreadId(pool);
+    assert(_IsExternalSlot(pool, thread_id));
+    Thread& thread = pool->threads[thread_id];
+    assert(thread.registered.load());
+    // help until no task in our storage is queued or running
+    while (thread.num_stored.load(std::memory_order_acquire) != 0) {
+        Task* const task = _GetTask(&thread);
+        if (task) {
+            _RunTask(&thread, task);
+        } else {
+            // the rest are running on other threads
+            std::this_thread::yield();
+        }
+    }
+    _ClearThreadId(pool);
+    thread.registered.store(false);
+}
+
+void tpSpawnTask(TaskPool* pool, TaskFunction* function, void* data,
+                 TaskCompletion* completion)
+{
+    _SpawnTask(pool, function, data, completion, nullptr, false);
+}
+
+int tpTrySpawnTask(TaskPool* pool, TaskFunction* function, void* data,
+                   TaskCompletion* completion)
+{
+    return _SpawnTask(pool, function, data, completion, nullptr, true);
+}
+
+void tpSpawnCancellableTask(TaskPool* pool, TaskFunction* function, void* data,
+                            TaskCompletion* completion,
+                            TaskCancellation const* cancellation)
+{
+    _SpawnTask(pool, function, data, completion, cancellation, false);
+}
+
+void tpInjectTask(TaskPool* pool, TaskFunction* function, void* data,
+                  TaskCompletion* completion)
+{
+    _InjectTask(pool, function, data, completion, nullptr, false);
+}
+
+void tpForkTask(TaskPool* pool, TaskFunction* child, void* child_data,
+                TaskFunction* continuation, void* continuation_data,
+                TaskCompletion* completion)
+{
+    _ForkTask(pool, child, child_data, continuation, continuation_data, completion, nullptr,
+              pool->spawn_policy);
+}
+
+void tpForkTaskWithPolicy(TaskPool* pool, TaskFunction* child, void* child_data,
+                          TaskFunction* continuation, void* continuation_data,
+                          TaskCompletion* completion, int policy)
+{
+    _ForkTask(pool, child, child_data, continuation, continuation_data, completion, nullptr,
+              policy);
+}
+
+int tpGetSpawnPolicy(TaskPool const* pool)
+{
+    return pool->spawn_policy;
+}
+
+void tpCancel(TaskCancellation* cancellation)
+{
+    AtomicAdd(cancellation, 1);
+}
+
+int tpIsCancelled(void)
+{
+    return _current_cancellation != nullptr && *_current_cancellation != 0;
+}
+
+int tpRunPendingTask(TaskPool* pool)
+{
+    if (pool->deterministic) {
+        return _RunsSeededTasks(pool) && (_RunSeededTask(pool) || _RunSeededFallbackTask(pool)) ? 1 : 0;
+    }
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        return 0;
+    }
+    Thread* thread = &pool->threads[thread_id];
+    Task* task = _GetTask(thread);
+    if (task == nullptr) {
+        return 0;
+    }
+    _RunTask(thread, task);
+    return 1;
+}
+
+uint64_t tpGetTime(void)
+{
+    return _GetTimeUs();
+}
+
+void tpSpawnTaskAt(TaskPool* pool, uint64_t time_us, TaskFunction* function,
+                   void* data, TaskCompletion* completion)
+{
+    _AddTimer(pool, time_us, 0, function, data, completion, nullptr);
+}
+
+void tpSpawnTaskAfterDelay(TaskPool* pool, uint64_t delay_us,
+                           TaskFunction* function, void* data,
+                           TaskCompletion* completion)
+{
+    _AddTimer(pool, _GetTimeUs() + delay_us, 0, function, data, completion, nullptr);
+}
+
+void tpSpawnPeriodicTask(TaskPool* pool, uint64_t period_us,
+                         TaskFunction* function, void* data,
+                         TaskCompletion* completion,
+                         TaskCancellation const* cancellation)
+{
+    assert(cancellation != nullptr);
+    if (period_us < kMicrosecondsPerTick) {
+        period_us = kMicrosecondsPerTick;
+    }
+    _AddTimer(pool, _GetTimeUs() + period_us, period_us, function, data,
+              completion, cancellation);
+}
+
+void tpReadAsync(TaskPool* pool, int fd, void* buffer, size_t size,
+                 uint64_t offset, AsyncIoFunction* function, void* data,
+                 TaskCompletion* completion)
+{
+    AsyncIo& io = pool->io;
+    _StartAsyncIo(pool);
+    if (completion) {
+        _AcquireCompletion(pool, completion);
+    }
+    _CountSpawned(pool);
+#if defined(TP_HAVE_IO_URING)
+    if (io.use_ring) {
+        // keep the completion queue from overflowing
+        while (io.in_flight.fetch_add(1) >= kMaxIoInFlight) {
+            io.in_flight--;
+            if (tpRunPendingTask(pool) == 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+#endif
+    bool first_pending = false;
+    {
+        std::lock_guard<std::mutex> lock(io.mutex);
+        IoRequest* request = io.free_requests;
+        if (request) {
+            io.free_requests = request->next;
+        } else {
+            request = (IoRequest*)pool->allocator.allocate_function(sizeof(IoRequest), pool->allocator.user_data);
+            assert(request != nullptr);
+            request->next_allocated = io.allocated_requests;
+            io.allocated_requests = request;
+        }
+        request->next = nullptr;
+        request->pool = pool;
+        request->function = function;
+        request->user_data = data;
+        request->completion = completion;
+        request->fd = fd;
+        request->buffer = buffer;
+        request->size = size < (size_t)kMaxIoSize ? size : (size_t)kMaxIoSize;
+        request->offset = offset;
+        request->result = 0;
+#if defined(TP_HAVE_IO_URING)
+        if (io.use_ring) {
+            // in_flight bounds the queued requests, so there's always room
+            int const full = io.ring.prepare_read(fd, buffer, (unsigned)request->size, offset,
+                                                  (uint64_t)(uintptr_t)request);
+            assert(full == 0);
+            (void)full;
+            if (io.ring.pending() >= kIoBatchSize) {
+                io.ring.submit();
+            }
+            first_pending = io.ring.pending() == 1;
+            io.pending.store((int)io.ring.pending());
+        }
+#endif
+        if (!io.use_ring) {
+            if (io.blocking_tail) {
+                io.blocking_tail->next = request;
+            } else {
+                io.blocking_head = request;
+            }
+            io.blocking_tail = request;
+            io.condition.notify_one();
+        }
+    }
+    if (first_pending) {
+        // have an idle worker submit the batch
+        std::lock_guard<std::mutex> lock(pool->wake_mutex);
+        _NotifyWorkers(pool);
+    }
+}
+
+int tpWatchFd(TaskPool* pool, int fd, int events, WatchFunction* function,
+              void* data)
+{
+#if defined(TP_HAVE_EPOLL)
+    if (fd < 0) {
+        return -EBADF;
+    }
+    Reactor& reactor = pool->reactor;
+    {
+        std::lock_guard<std::mutex> lock(reactor.mutex);
+        int result = _StartReactor(pool);
+        if (result == 0) {
+            result = _ReserveWatch(pool, fd);
+        }
+        if (result != 0) {
+            return result;
+        }
+        FdWatch& watch = reactor.watches[fd];
+        bool const was_armed = watch.armed;
+        watch.function = function;
+        watch.user_data = data;
+        watch.generation++;
+        watch.armed = true;
+
+        epoll_event event = {};
+        event.events = EPOLLONESHOT | EPOLLRDHUP;
+        if (events & kWatchRead) {
+            event.events |= EPOLLIN;
+        }
+        if (events & kWatchWrite) {
+            event.events |= EPOLLOUT;
+        }
+        event.data.u64 = ((uint64_t)watch.generation << 32) | (uint32_t)fd;
+        // fds stay registered after a one-shot watch fires
+        result = epoll_ctl(reactor.epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        if (result < 0 && errno == ENOENT) {
+            result = epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        }
+        if (result < 0) {
+            watch.armed = false;
+            if (was_armed) {
+                reactor.num_armed--;
+            }
+            return -errno;
+        }
+        if (!was_armed) {
+            reactor.num_armed++;
+        }
+    }
+    // a sleeping worker has to take up polling
+    std::lock_guard<std::mutex> lock(pool->wake_mutex);
+    _NotifyWorkers(pool);
+    return 0;
+#else
+    (void)pool;
+    (void)fd;
+    (void)events;
+    (void)function;
+    (void)data;
+    return -ENOSYS;
+#endif
+}
+
+void tpUnwatchFd(TaskPool* pool, int fd)
+{
+#if defined(TP_HAVE_EPOLL)
+    Reactor& reactor = pool->reactor;
+    std::lock_guard<std::mutex> lock(reactor.mutex);
+    if (fd < 0 || fd >= reactor.num_watches) {
+        return;
+    }
+    FdWatch& watch = reactor.watches[fd];
+    if (watch.armed) {
+        watch.armed = false;
+        reactor.num_armed--;
+    }
+    watch.generation++;
+    epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+#else
+    (void)pool;
+    (void)fd;
+#endif
+}
+
+int tpCreateCompletionEvent(TaskPool* pool, TaskCompletion* completion)
+{
+#if defined(TP_HAVE_EVENTFD)
+    std::lock_guard<std::mutex> lock(pool->completion_event_mutex);
+    for (int ii = 0; ii < kMaxCompletionEvents; ++ii) {
+        CompletionEvent& event = pool->completion_events[ii];
+        if (event.completion.load() == completion) {
+            return event.fd;
+        }
+    }
+    for (int ii = 0; ii < kMaxCompletionEvents; ++ii) {
+        CompletionEvent& event = pool->completion_events[ii];
+        if (event.completion.load() != nullptr) {
+            continue;
+        }
+        int const fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fd < 0) {
+            return -errno;
+        }
+        event.fd = fd;
+        event.armed.store(true);
+        event.completion.store(completion);
+        pool->num_completion_events++;
+        return fd;
+    }
+    return -ENOSPC;
+#else
+    (void)pool;
+    (void)completion;
+    return -ENOSYS;
+#endif
+}
+
+void tpAcknowledgeCompletionEvent(TaskPool* pool, TaskCompletion* completion)
+{
+#if defined(TP_HAVE_EVENTFD)
+    for (int ii = 0; ii < kMaxCompletionEvents; ++ii) {
+        CompletionEvent& event = pool->completion_events[ii];
+        if (event.completion.load() == completion) {
+            uint64_t value = 0;
+            ssize_t const num_read = read(event.fd, &value, sizeof(value));
+            (void)num_read;
+            event.armed.store(true);
+            return;
+        }
+    }
+#else
+    (void)pool;
+    (void)completion;
+#endif
+}
+
+void tpDestroyCompletionEvent(TaskPool* pool, TaskCompletion* completion)
+{
+#if defined(TP_HAVE_EVENTFD)
+    std::lock_guard<std::mutex> lock(pool->completion_event_mutex);
+    for (int ii = 0; ii < kMaxCompletionEvents; ++ii) {
+        CompletionEvent& event = pool->completion_events[ii];
+        if (event.completion.load() != completion) {
+            continue;
+        }
+        event.completion.store(nullptr);
+        pool->num_completion_events--;
+        while (event.writers.load() != 0) {
+            std::this_thread::yield();
+        }
+        close(event.fd);
+        event.fd = -1;
+        return;
+    }
+#else
+    (void)pool;
+    (void)completion;
+#endif
+}
+
+namespace {
+/* helps the pool until done() returns true. Tasks counted in preferred come
+ * first, then the ones the thread's last thief spawned, and only then any
+ * task. Every unrelated task can wait in turn and nest another call on the
+ * stack, and can run long after done() became true, so past kMaxHelpDepth
+ * nested waits the thread stops taking them. It still does after
+ * kMaxHelpStalls rounds without anything else to run, for waits on tasks
+ * that come from timers, I/O or other threads' injections */
+template<typename Done>
+void _WaitUntil(TaskPool* pool, Done const& done, TaskCompletion const* preferred)
+{
+    if (pool->deterministic) {
+        while (!done()) {
+            _HelpSeededPool(pool);
+        }
+        return;
+    }
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        // threads without a queue leave the work to the pool
+        while (!done()) {
+            std::this_thread::yield();
+        }
+        return;
+    }
+    Thread* thread = &pool->threads[thread_id];
+    bool const bounded = thread->help_depth >= kMaxHelpDepth;
+    int num_stalls = 0;
+    thread->help_depth++;
+    while (!done()) {
+        Task* next_task = _GetTaskFor(thread, preferred);
+        if (next_task == nullptr) {
+            next_task = _StealFromThief(thread);
+        }
+        if (next_task == nullptr && (!bounded || ++num_stalls >= kMaxHelpStalls)) {
+            next_task = _GetTask(thread);
+        }
+        if (next_task) {
+            num_stalls = 0;
+            _RunTask(thread, next_task);
+        } else if (pool->reactor.num_armed.load(std::memory_order_relaxed) != 0) {
+            // the workers may all be waiting too
+            _PollFds(thread, 0);
+        } else if (bounded) {
+            std::this_thread::yield();
+        }
+    }
+    thread->help_depth--;
+}
+} // anonymous namespace
+
+void tpWaitForCompletion(TaskPool* pool, TaskCompletion* completion)
+{
+    _WaitUntil(pool, [completion]() { return *completion == 0; }, completion);
+}
+
+ShardedCompletion* tpCreateShardedCompletion(TaskPool* pool)
+{
+    int const num_shards = pool->num_slots + 1;
+    size_t const size = sizeof(ShardedCompletion) + sizeof(CompletionShard) * (num_shards - 1);
+    void* allocation = nullptr;
+    void* const memory = _AllocateAligned(&pool->allocator, size, &allocation);
+    if (memory == nullptr) {
+        return nullptr;
+    }
+    memset(memory, 0, size);
+    ShardedCompletion* completion = (ShardedCompletion*)memory;
+    completion->allocation = allocation;
+    completion->num_shards = num_shards;
+    return completion;
+}
+
+void tpDestroyShardedCompletion(TaskPool* pool, ShardedCompletion* completion)
+{
+    if (completion) {
+        assert(_IsShardedDone(completion));
+        pool->allocator.free_function(completion->allocation, pool->allocator.user_data);
+    }
+}
+
+void tpSpawnShardedTask(TaskPool* pool, TaskFunction* function, void* data,
+                        ShardedCompletion* completion)
+{
+    _SpawnTask(pool, function, data, _TagShardedCompletion(completion), nullptr, false);
+}
+
+int tpIsShardedCompletionDone(ShardedCompletion const* completion)
+{
+    return _IsShardedDone(completion) ? 1 : 0;
+}
+
+void tpWaitForShardedCompletion(TaskPool* pool, ShardedCompletion* completion)
+{
+    _WaitUntil(pool, [completion]() { return _IsShardedDone(completion); },
+               _TagShardedCompletion(completion));
+}
+
+namespace {
+/* true if the group and every group nested in it have no tasks left. The
+ * group's own count is read again last, since a task of a nested group may
+ * have spawned into it before finishing */
+bool _IsTaskGroupDone(TaskGroup* group)
+{
+    if (group->completion != 0) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(group->mutex);
+        for (TaskGroup* child = group->first_child; child; child = child->next_sibling) {
+            if (!_IsTaskGroupDone(child)) {
+                return false;
+            }
+        }
+    }
+    return group->completion == 0;
+}
+
+void _CancelTaskGroup(TaskGroup* group)
+{
+    std::lock_guard<std::mutex> lock(group->mutex);
+    tpCancel(&group->cancellation);
+    for (TaskGroup* child = group->first_child; child; child = child->next_sibling) {
+        _CancelTaskGroup(child);
+    }
+}
+
+void _AddTaskGroupStats(TaskGroup* group, TaskGroupStats* stats)
+{
+    std::lock_guard<std::mutex> lock(group->mutex);
+    stats->num_spawned += group->num_spawned.load(std::memory_order_relaxed);
+    stats->num_finished += group->num_finished.load(std::memory_order_relaxed);
+    stats->num_skipped += group->num_skipped.load(std::memory_order_relaxed);
+    stats->num_groups++;
+    for (TaskGroup* child = group->first_child; child; child = child->next_sibling) {
+        _AddTaskGroupStats(child, stats);
+    }
+}
+} // anonymous namespace
+
+TaskGroup* tpCreateTaskGroup(TaskPool* pool, TaskGroup* parent)
+{
+    void* const memory = pool->allocator.allocate_function(sizeof(TaskGroup), pool->allocator.user_data);
+    if (memory == nullptr) {
+        return nullptr;
+    }
+    assert(((uintptr_t)memory & (kShardedCompletionTag | kTaskGroupTag)) == 0);
+    TaskGroup* group = new (memory) TaskGroup;
+    group->pool = pool;
+    group->parent = parent;
+    if (parent) {
+        std::lock_guard<std::mutex> lock(parent->mutex);
+        group->cancellation = parent->cancellation;
+        group->next_sibling = parent->first_child;
+        if (parent->first_child) {
+            parent->first_child->prev_sibling = group;
+        }
+        parent->first_child = group;
+    }
+    return group;
+}
+
+void tpDestroyTaskGroup(TaskGroup* group)
+{
+    if (group == nullptr) {
+        return;
+    }
+    tpWaitForTaskGroup(group);
+    assert(group->first_child == nullptr && "destroy nested groups first");
+    TaskGroup* const parent = group->parent;
+    if (parent) {
+        // the parent's stats keep what this group counted
+        std::lock_guard<std::mutex> lock(parent->mutex);
+        if (group->prev_sibling) {
+            group->prev_sibling->next_sibling = group->next_sibling;
+        } else {
+            parent->first_child = group->next_sibling;
+        }
+        if (group->next_sibling) {
+            group->next_sibling->prev_sibling = group->prev_sibling;
+        }
+        parent->num_spawned.fetch_add(group->num_spawned.load(), std::memory_order_relaxed);
+        parent->num_finished.fetch_add(group->num_finished.load(), std::memory_order_relaxed);
+        parent->num_skipped.fetch_add(group->num_skipped.load(), std::memory_order_relaxed);
+    }
+    TaskPool* const pool = group->pool;
+    group->~TaskGroup();
+    pool->allocator.free_function(group, pool->allocator.user_data);
+}
+
+void tpSpawnGroupTask(TaskGroup* group, TaskFunction* function, void* data)
+{
+    _SpawnTask(group->pool, function, data, _TagTaskGroup(group), &group->cancellation, false);
+}
+
+void tpForkGroupTask(TaskGroup* group, TaskFunction* child, void* child_data,
+                     TaskFunction* continuation, void* continuation_data, int policy)
+{
+    _ForkTask(group->pool, child, child_data, continuation, continuation_data,
+              _TagTaskGroup(group), &group->cancellation, policy);
+}
+
+void tpSetTaskGroupSkipFunction(TaskGroup* group, TaskFunction* function)
+{
+    group->skip_function = function;
+}
+
+void tpWaitForTaskGroup(TaskGroup* group)
+{
+    _WaitUntil(group->pool, [group]() { return _IsTaskGroupDone(group); }, _TagTaskGroup(group));
+}
+
+void tpCancelTaskGroup(TaskGroup* group)
+{
+    _CancelTaskGroup(group);
+}
+
+int tpIsTaskGroupCancelled(TaskGroup const* group)
+{
+    return group->cancellation != 0 ? 1 : 0;
+}
+
+void tpGetTaskGroupStats(TaskGroup* group, TaskGroupStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    _AddTaskGroupStats(group, stats);
+}
+
+void tpFinishAllWork(TaskPool* pool)
+{
+    if (pool->deterministic) {
+        while (!_IsQuiescent(pool)) {
+            _HelpSeededPool(pool);
+        }
+        return;
+    }
+    int const thread_id = _ThreadId(pool);
+    if (thread_id < 0) {
+        while (!_IsQuiescent(pool)) {
+            std::this_thread::yield();
+        }
+        return;
+    }
+    Thread* thread = &pool->threads[thread_id];
+    Task* task = _GetTask(thread);
+    while (task || !_IsQuiescent(pool)) {
+        if (task) {
+            _RunTask(thread, task);
+        }
+        task = _GetTask(thread);
+    }
+}
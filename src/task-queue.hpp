@@ -3,13 +3,59 @@
 #include <assert.h>
 #include <atomic>
 
-#if defined(_MSC_VER)
-    #include <intrin.h>
-    #define AtomicCompareAndSwap(addr, desired, expected) _InterlockedCompareExchange64(addr, desired, expected)
+// older kernel headers and some sysroots have no membarrier.h
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/membarrier.h>)
+        #include <linux/membarrier.h>
+        #include <sys/syscall.h>
+        #include <unistd.h>
+        #if defined(__NR_membarrier)
+            #define TP_HAVE_MEMBARRIER 1
+        #endif
+    #endif
+#endif
+
+/// @brief Registers the process for expedited membarrier, which the
+///     asymmetric fence mode of TaskQueue relies on
+/// @return true if HeavyFence can be used
+inline bool RegisterHeavyFence()
+{
+#if defined(TP_HAVE_MEMBARRIER)
+    int const commands = (int)syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+    if (commands < 0 || (commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED) == 0) {
+        return false;
+    }
+    return syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
 #else
-    #define AtomicCompareAndSwap(addr, desired, expected) __sync_val_compare_and_swap(addr, expected, desired)
+    return false;
 #endif
+}
 
+/// @brief Makes every running thread of the process execute a full memory
+///     barrier, so a compiler-only barrier on their side pairs with this one
+///     as if both were sequentially consistent fences
+inline void HeavyFence()
+{
+#if defined(TP_HAVE_MEMBARRIER)
+    if (syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0) {
+        return;
+    }
+#endif
+    assert(false && "HeavyFence without RegisterHeavyFence");
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+/// @brief Chase-Lev work-stealing deque with a fixed capacity. The owner
+///     pushes and pops at the bottom, other threads steal from the top. The
+///     memory orderings are the ones Lê, Pop, Cohen and Zappa Nardelli proved
+///     sufficient in "Correct and Efficient Work-Stealing for Weak Memory
+///     Models" (PPoPP 2013): the owner only pays for a sequentially consistent
+///     fence in pop, and for a CAS when it races a thief for the last item.
+///     push reads top only when a cached copy says the queue is full.
+///
+///     With asymmetric fences the fence in pop becomes a compiler barrier and
+///     steal pays for a HeavyFence instead, which is only worth it when
+///     steals are rare next to pops.
 template<uint32_t kMaxCount = 1024>
 class TaskQueue {
 public:
@@ -18,59 +64,105 @@ public:
     ///     this call.
     int64_t size()const
     {
-        return this->_bottom - this->_top;
+        return this->_bottom.load(std::memory_order_relaxed) -
+               this->_top.load(std::memory_order_relaxed);
+    }
+
+    /// @brief Switches between a sequentially consistent fence in both pop and
+    ///     steal, and a compiler barrier in pop paired with a HeavyFence in
+    ///     steal. Only call this while no other thread uses the queue, and
+    ///     only turn it on after RegisterHeavyFence succeeded
+    void set_asymmetric_fences(bool enable)
+    {
+        this->_asymmetric = enable;
     }
 
     /// @brief Pushes a new item onto the bottom of the queue
     /// @return 0 on success, 1 on failure (queue is full)
     int push(struct Task* value)
     {
-        if (this->size() == kMaxCount) {
-            return 1;
+        int64_t const bottom = this->_bottom.load(std::memory_order_relaxed);
+        if (bottom - this->_top_cache >= (int64_t)kMaxCount) {
+            // top only grows, so only a queue that looks full needs a fresh
+            // look at the line the thieves write to
+            this->_top_cache = this->_top.load(std::memory_order_acquire);
+            if (bottom - this->_top_cache >= (int64_t)kMaxCount) {
+                return 1;
+            }
         }
 
-        int64_t const bottom = this->_bottom;
-        this->_data[bottom & kQueueMask] = value;
-
-        std::atomic_signal_fence(std::memory_order_seq_cst);
-
-        this->_bottom = bottom + 1;
+        this->_data[bottom & kQueueMask].store(value, std::memory_order_relaxed);
+        // publishes the item to thieves that read the new bottom
+        std::atomic_thread_fence(std::memory_order_release);
+        this->_bottom.store(bottom + 1, std::memory_order_relaxed);
 
         return 0;
     }
 
     Task* pop()
     {
-        int64_t bottom = this->_bottom - 1;
-        this->_bottom = bottom;
-        std::atomic_thread_fence(std::memory_order_seq_cst);
-        int64_t top = this->_top;
+        int64_t const bottom = this->_bottom.load(std::memory_order_relaxed) - 1;
+        this->_bottom.store(bottom, std::memory_order_relaxed);
+        // the store to bottom has to be visible before top is read, or a
+        // thief and the owner could both take the last item
+        if (this->_asymmetric) {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        } else {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        int64_t top = this->_top.load(std::memory_order_relaxed);
 
         if (top <= bottom) {
-            struct Task* value = this->_data[bottom & kQueueMask];
+            struct Task* value = this->_data[bottom & kQueueMask].load(std::memory_order_relaxed);
             if (top != bottom) {
                 return value;
             }
-            if (AtomicCompareAndSwap(&this->_top, top + 1, top) != top) {
+            // last item, race the thieves for it
+            if (!this->_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                    std::memory_order_relaxed)) {
                 value = NULL;
             }
-            this->_bottom = top + 1;
+            this->_bottom.store(bottom + 1, std::memory_order_relaxed);
             return value;
         } else {
-            this->_bottom = top;
+            this->_bottom.store(bottom + 1, std::memory_order_relaxed);
             return NULL;
         }
     }
 
     Task* steal()
     {
-        int64_t top = this->_top;
-        std::atomic_signal_fence(std::memory_order_seq_cst);
-        int64_t bottom = this->_bottom;
+        return this->steal_if(AnyTask());
+    }
+
+    /// @brief Steals the oldest item, but only if predicate(item) is true.
+    ///     The predicate runs before the steal is decided, so it may see an
+    ///     item another thread takes first; it should only read from it
+    template<typename Predicate>
+    Task* steal_if(Predicate const& predicate)
+    {
+        int64_t top = this->_top.load(std::memory_order_acquire);
+        int64_t bottom;
+        if (this->_asymmetric) {
+            // skip the system call when the queue looks empty; a stale bottom
+            // only makes the steal fail, which it's allowed to do anyway
+            if (top >= this->_bottom.load(std::memory_order_relaxed)) {
+                return NULL;
+            }
+            HeavyFence();
+            bottom = this->_bottom.load(std::memory_order_acquire);
+        } else {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bottom = this->_bottom.load(std::memory_order_acquire);
+        }
 
         if (top < bottom) {
-            struct Task* value = this->_data[top & kQueueMask];
-            if (AtomicCompareAndSwap(&this->_top, top + 1, top) != top) {
+            struct Task* value = this->_data[top & kQueueMask].load(std::memory_order_relaxed);
+            if (!predicate(value)) {
+                return NULL;
+            }
+            if (!this->_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                                    std::memory_order_relaxed)) {
                 return NULL;
             }
             return value;
@@ -80,11 +172,20 @@ public:
     }
 
 private:
+    struct AnyTask {
+        bool operator()(struct Task const*)const { return true; }
+    };
+
     enum {
         kQueueMask = kMaxCount - 1,
+        kCacheLineSize = 64,
     };
 
-    struct Task*        _data[kMaxCount] = {nullptr};
-    volatile int64_t    _top = 0;
-    volatile int64_t    _bottom = 0;
+    std::atomic<struct Task*>   _data[kMaxCount] = {};
+    // thieves CAS top while the owner writes bottom, so each gets its own
+    // line; the owner-only fields share bottom's
+    alignas(kCacheLineSize) std::atomic<int64_t> _top = {0};
+    alignas(kCacheLineSize) std::atomic<int64_t> _bottom = {0};
+    int64_t                     _top_cache = 0; // owner only, never ahead of top
+    bool                        _asymmetric = false;
 };
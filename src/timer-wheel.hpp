@@ -0,0 +1,188 @@
+#pragma once
+#include <stdint.h>
+#include <assert.h>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #pragma intrinsic(_BitScanForward64)
+    inline int CountTrailingZeros(uint64_t value)
+    {
+        unsigned long index = 0;
+        _BitScanForward64(&index, value);
+        return (int)index;
+    }
+#else
+    inline int CountTrailingZeros(uint64_t value)
+    {
+        return __builtin_ctzll(value);
+    }
+#endif
+
+/// @brief Hierarchical timing wheel. Level L has 64 slots that are each
+///     64^L ticks wide, so inserting is O(1) and each timer is moved down at
+///     most once per level before it expires. Deadlines beyond the top level
+///     wait in an overflow list. Timers are intrusive: Timer needs a
+///     `Timer* next` and a `uint64_t deadline` in ticks. The wheel isn't
+///     thread-safe.
+template<typename Timer>
+class TimerWheel {
+public:
+    enum : uint64_t {
+        kNoDeadline = ~0ull,
+    };
+
+    explicit TimerWheel(uint64_t current_tick = 0)
+        : _current(current_tick)
+    {
+        for (int ii = 0; ii < kNumLevels; ++ii) {
+            this->_occupied[ii] = 0;
+            for (int jj = 0; jj < kSlotsPerLevel; ++jj) {
+                this->_slots[ii][jj] = nullptr;
+            }
+        }
+    }
+
+    uint64_t current_tick()const { return this->_current; }
+    uint64_t size()const { return this->_count; }
+
+    /// @brief Adds a timer. Deadlines that already passed expire on the next
+    ///     tick
+    void insert(Timer* timer)
+    {
+        if (timer->deadline <= this->_current) {
+            timer->deadline = this->_current + 1;
+        }
+        this->_place(timer);
+        ++this->_count;
+    }
+
+    /// @brief Moves the wheel forward to now_tick
+    /// @return A list, linked through next, of the timers that expired
+    Timer* advance(uint64_t now_tick)
+    {
+        Timer* expired = nullptr;
+        while (this->_current < now_tick) {
+            if (this->_count == 0) {
+                this->_current = now_tick;
+                break;
+            }
+            uint64_t const tick = this->_next_tick(now_tick);
+            this->_current = tick;
+            if ((tick & kSlotMask) == 0) {
+                this->_cascade(tick);
+            }
+            int const slot = (int)(tick & kSlotMask);
+            Timer* timer = this->_slots[0][slot];
+            this->_slots[0][slot] = nullptr;
+            this->_occupied[0] &= ~(1ull << slot);
+            while (timer) {
+                Timer* const next = timer->next;
+                timer->next = expired;
+                expired = timer;
+                --this->_count;
+                timer = next;
+            }
+        }
+        return expired;
+    }
+
+    /// @brief Returns the earliest tick at which advance can have something to
+    ///     do: the next expiry, or the next time timers move down a level
+    uint64_t next_deadline()const
+    {
+        if (this->_count == 0) {
+            return kNoDeadline;
+        }
+        uint64_t const next = this->_current + 1;
+        int const offset = (int)(next & kSlotMask);
+        uint64_t const bits = offset ? (this->_occupied[0] >> offset) : this->_occupied[0];
+        if (offset && bits) {
+            return next + CountTrailingZeros(bits);
+        }
+        if (offset == 0 && bits & 1) {
+            return next;
+        }
+        // nothing more in this block of level 0
+        return (this->_current | kSlotMask) + 1;
+    }
+
+private:
+    enum {
+        kLevelBits = 6,
+        kSlotsPerLevel = 1 << kLevelBits,
+        kSlotMask = kSlotsPerLevel - 1,
+        kNumLevels = 4,
+    };
+
+    /* places a timer with deadline >= current */
+    void _place(Timer* timer)
+    {
+        uint64_t const delta = timer->deadline - this->_current;
+        for (int level = 0; level < kNumLevels; ++level) {
+            if (delta < (1ull << (kLevelBits * (level + 1)))) {
+                int const slot = (int)((timer->deadline >> (kLevelBits * level)) & kSlotMask);
+                timer->next = this->_slots[level][slot];
+                this->_slots[level][slot] = timer;
+                this->_occupied[level] |= 1ull << slot;
+                return;
+            }
+        }
+        timer->next = this->_overflow;
+        this->_overflow = timer;
+    }
+
+    /* the next tick worth looking at: one with expiring timers in level 0, a
+     * level 0 wrap-around, or now_tick */
+    uint64_t _next_tick(uint64_t now_tick)const
+    {
+        uint64_t const next = this->_current + 1;
+        int const offset = (int)(next & kSlotMask);
+        if (offset == 0) {
+            return next;
+        }
+        uint64_t const bits = this->_occupied[0] >> offset;
+        uint64_t const candidate = bits ? next + CountTrailingZeros(bits)
+                                        : (next | kSlotMask) + 1;
+        return candidate < now_tick ? candidate : now_tick;
+    }
+
+    /* moves the timers that are due within the block starting at tick into the
+     * levels below, highest level first */
+    void _cascade(uint64_t tick)
+    {
+        int top = 1;
+        while (top < kNumLevels &&
+               (tick & ((1ull << (kLevelBits * (top + 1))) - 1)) == 0) {
+            ++top;
+        }
+        if (top == kNumLevels) {
+            Timer* timer = this->_overflow;
+            this->_overflow = nullptr;
+            this->_reinsert(timer);
+            top = kNumLevels - 1;
+        }
+        for (int level = top; level > 0; --level) {
+            int const slot = (int)((tick >> (kLevelBits * level)) & kSlotMask);
+            Timer* timer = this->_slots[level][slot];
+            this->_slots[level][slot] = nullptr;
+            this->_occupied[level] &= ~(1ull << slot);
+            this->_reinsert(timer);
+        }
+    }
+
+    void _reinsert(Timer* timer)
+    {
+        while (timer) {
+            Timer* const next = timer->next;
+            assert(timer->deadline >= this->_current);
+            this->_place(timer);
+            timer = next;
+        }
+    }
+
+    Timer*      _slots[kNumLevels][kSlotsPerLevel];
+    uint64_t    _occupied[kNumLevels];
+    Timer*      _overflow = nullptr;
+    uint64_t    _current;
+    uint64_t    _count = 0;
+};
@@ -0,0 +1,124 @@
+#if defined(_MSC_VER)
+    #pragma warning(push)
+    #pragma warning(disable:28182) // dereferencing NULL pointer (within Gtest)
+    #include <gtest/gtest.h>
+    #pragma warning(pop)
+#else
+    #include <gtest/gtest.h>
+#endif // #if defined(_MSC_VER)
+#include <atomic>
+
+#include "task-pool/coroutine.hpp"
+
+namespace {
+
+struct Coroutines : public ::testing::Test {
+    void SetUp(void)
+    {
+        pool = tpCreatePool(4, nullptr);
+        ASSERT_NE(nullptr, pool);
+    }
+    void TearDown(void)
+    {
+        tpDestroyPool(pool);
+    }
+
+    TaskPool* pool = nullptr;
+};
+
+tp::task<int> _Double(TaskPool* pool, int value)
+{
+    co_await tp::schedule(pool);
+    co_return value * 2;
+}
+
+tp::task<int> _Chain(TaskPool* pool, int depth)
+{
+    if (depth == 0) {
+        co_return 0;
+    }
+    int const value = co_await _Chain(pool, depth - 1);
+    co_return value + 1;
+}
+
+tp::task<void> _Increment(TaskPool* pool, std::atomic<int>* counter)
+{
+    co_await tp::schedule(pool);
+    counter->fetch_add(1);
+}
+
+TEST_F(Coroutines, ScheduleRunsOnPool)
+{
+    ASSERT_EQ(42, tp::sync_wait(pool, _Double(pool, 21)));
+}
+TEST_F(Coroutines, TasksAreLazy)
+{
+    std::atomic<int> counter = {0};
+    tp::task<void> task = _Increment(pool, &counter);
+    tpFinishAllWork(pool);
+    ASSERT_EQ(0, counter.load());
+    tp::sync_wait(pool, std::move(task));
+    ASSERT_EQ(1, counter.load());
+}
+/* symmetric transfer only becomes a tail call when the compiler optimizes,
+ * unoptimized builds get a chain that fits on the stack without one */
+#if defined(__OPTIMIZE__)
+enum { kChainDepth = 100 * 1000 };
+#else
+enum { kChainDepth = 1000 };
+#endif
+TEST_F(Coroutines, DeepChainsUseSymmetricTransfer)
+{
+    ASSERT_EQ((int)kChainDepth, tp::sync_wait(pool, _Chain(pool, kChainDepth)));
+}
+TEST_F(Coroutines, WhenAllReturnsResultsInOrder)
+{
+    std::vector<tp::task<int>> tasks;
+    for (int ii = 0; ii < 100; ++ii) {
+        tasks.push_back(_Double(pool, ii));
+    }
+    std::vector<int> const results = tp::sync_wait(pool, tp::when_all(pool, std::move(tasks)));
+    ASSERT_EQ(100u, results.size());
+    for (int ii = 0; ii < 100; ++ii) {
+        ASSERT_EQ(ii * 2, results[ii]);
+    }
+}
+TEST_F(Coroutines, WhenAllWaitsForVoidTasks)
+{
+    std::atomic<int> counter = {0};
+    std::vector<tp::task<void>> tasks;
+    for (int ii = 0; ii < 100; ++ii) {
+        tasks.push_back(_Increment(pool, &counter));
+    }
+    tp::sync_wait(pool, tp::when_all(pool, std::move(tasks)));
+    ASSERT_EQ(100, counter.load());
+}
+TEST_F(Coroutines, WhenAllOfNothingCompletes)
+{
+    ASSERT_TRUE(tp::sync_wait(pool, tp::when_all(pool, std::vector<tp::task<int>>())).empty());
+}
+
+TEST(CoroutineFrames, AllocatedFromPoolAllocator)
+{
+    static std::atomic<int> num_allocations = {0};
+    auto const allocate = [](size_t size, void*) -> void* {
+        num_allocations++;
+        return malloc(size);
+    };
+    auto const deallocate = [](void* data, void*) -> void {
+        num_allocations--;
+        free(data);
+    };
+    AllocationCallbacks const allocator = { allocate, deallocate, nullptr };
+    TaskPool* pool = tpCreatePool(2, &allocator);
+    int const allocations_before = num_allocations.load();
+    {
+        tp::task<int> task = _Double(pool, 1);
+        ASSERT_EQ(allocations_before + 1, num_allocations.load());
+        ASSERT_EQ(2, tp::sync_wait(pool, std::move(task)));
+    }
+    ASSERT_EQ(allocations_before, num_allocations.load());
+    tpDestroyPool(pool);
+}
+
+}
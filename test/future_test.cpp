@@ -0,0 +1,151 @@
+#if defined(_MSC_VER)
+    #pragma warning(push)
+    #pragma warning(disable:28182) // dereferencing NULL pointer (within Gtest)
+    #include <gtest/gtest.h>
+    #pragma warning(pop)
+#else
+    #include <gtest/gtest.h>
+#endif // #if defined(_MSC_VER)
+#include <stdlib.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "task-pool/future.hpp"
+
+namespace {
+
+struct Futures : public ::testing::Test {
+    void SetUp(void)
+    {
+        pool = tpCreatePool(4, nullptr);
+        ASSERT_NE(nullptr, pool);
+    }
+    void TearDown(void)
+    {
+        tpDestroyPool(pool);
+    }
+
+    TaskPool* pool = nullptr;
+};
+
+TEST_F(Futures, AsyncReturnsValue)
+{
+    tp::Future<int> future = tp::async(pool, []() { return 42; });
+    ASSERT_TRUE(future.valid());
+    ASSERT_EQ(42, future.get());
+    ASSERT_FALSE(future.valid());
+}
+TEST_F(Futures, ValuesAreMovedThrough)
+{
+    tp::Future<std::string> future = tp::async(pool, []() {
+        return std::string(1000, 'x');
+    });
+    ASSERT_EQ(1000u, future.get().size());
+}
+TEST_F(Futures, ThenChainsContinuations)
+{
+    tp::Future<int> future = tp::async(pool, []() { return 20; });
+    tp::Future<std::string> chained = std::move(future)
+        .then([](int value) { return value + 1; })
+        .then([](int value) { return std::to_string(value * 2); });
+    ASSERT_FALSE(future.valid());
+    ASSERT_EQ("42", chained.get());
+}
+TEST(FuturesWithAllocator, EachFutureIsOneAllocation)
+{
+    struct Counts {
+        std::atomic<int> allocations;
+        std::atomic<int> frees;
+    } counts = { {0}, {0} };
+    AllocationCallbacks allocator;
+    allocator.allocate_function = [](size_t size, void* user_data) {
+        ((Counts*)user_data)->allocations++;
+        return malloc(size);
+    };
+    allocator.free_function = [](void* data, void* user_data) {
+        ((Counts*)user_data)->frees++;
+        free(data);
+    };
+    allocator.user_data = &counts;
+    TaskPool* pool = tpCreatePool(2, &allocator);
+    ASSERT_NE(nullptr, pool);
+    int const allocations = counts.allocations.load();
+
+    tp::Future<int> future = tp::async(pool, []() { return 20; });
+    ASSERT_EQ(allocations + 1, counts.allocations.load());
+    tp::Future<int> chained = std::move(future).then([](int value) { return value + 22; });
+    ASSERT_EQ(allocations + 2, counts.allocations.load());
+    ASSERT_EQ(42, chained.get());
+
+    std::vector<tp::Future<int>> futures;
+    futures.push_back(tp::async(pool, []() { return 1; }));
+    futures.push_back(tp::async(pool, []() { return 2; }));
+    // the output state and the combinator with its elements
+    tp::Future<std::vector<int>> all = tp::when_all(pool, std::move(futures));
+    ASSERT_EQ(allocations + 6, counts.allocations.load());
+    ASSERT_EQ(2u, all.get().size());
+    tpFinishAllWork(pool);
+    ASSERT_EQ(counts.allocations.load() - allocations, counts.frees.load());
+    tpDestroyPool(pool);
+}
+TEST_F(Futures, ThenOnReadyFutureStillRuns)
+{
+    tp::Future<int> future = tp::async(pool, []() { return 1; });
+    future.wait();
+    ASSERT_TRUE(future.is_ready());
+    ASSERT_EQ(2, std::move(future).then([](int value) { return value * 2; }).get());
+}
+TEST_F(Futures, PromiseFulfillsFuture)
+{
+    tp::Promise<int> promise(pool);
+    tp::Future<int> future = promise.get_future();
+    ASSERT_FALSE(future.is_ready());
+    promise.set_value(7);
+    ASSERT_TRUE(future.is_ready());
+    ASSERT_EQ(7, future.get());
+}
+TEST_F(Futures, WaitingHelpsRunTasks)
+{
+    // every worker is parked, so only the waiting thread can run the task
+    tpSetActiveWorkers(pool, 0);
+    tp::Future<int> future = tp::async(pool, [this]() {
+        // nested waits help too
+        return tp::async(pool, []() { return 3; }).get() + 1;
+    });
+    ASSERT_EQ(4, future.get());
+}
+TEST_F(Futures, WhenAllKeepsInputOrder)
+{
+    std::vector<tp::Future<int>> futures;
+    for (int ii = 0; ii < 100; ++ii) {
+        futures.push_back(tp::async(pool, [ii]() { return ii; }));
+    }
+    std::vector<int> const values = tp::when_all(pool, std::move(futures)).get();
+    ASSERT_EQ(100u, values.size());
+    for (int ii = 0; ii < 100; ++ii) {
+        ASSERT_EQ(ii, values[ii]);
+    }
+}
+TEST_F(Futures, WhenAllOfNothingIsReady)
+{
+    tp::Future<std::vector<int>> future = tp::when_all(pool, std::vector<tp::Future<int>>());
+    ASSERT_TRUE(future.is_ready());
+    ASSERT_TRUE(future.get().empty());
+}
+TEST_F(Futures, WhenAnyReturnsFirstReadyValue)
+{
+    tp::Promise<int> never_first(pool);
+    std::vector<tp::Future<int>> futures;
+    futures.push_back(never_first.get_future());
+    futures.push_back(tp::async(pool, []() { return 5; }));
+    tp::Future<std::pair<size_t, int>> any = tp::when_any(pool, std::move(futures));
+    std::pair<size_t, int> const result = any.get();
+    ASSERT_EQ(1u, result.first);
+    ASSERT_EQ(5, result.second);
+    // the remaining input still has to be fulfilled before it is released
+    never_first.set_value(0);
+    tpFinishAllWork(pool);
+}
+
+}
@@ -0,0 +1,125 @@
+#if defined(_MSC_VER)
+    #pragma warning(push)
+    #pragma warning(disable:28182) // dereferencing NULL pointer (within Gtest)
+    #include <gtest/gtest.h>
+    #pragma warning(pop)
+#else
+    #include <gtest/gtest.h>
+#endif // #if defined(_MSC_VER)
+#include <thread>
+#include <vector>
+
+#include "../src/inject-queue.hpp"
+
+namespace {
+
+enum {
+    kMaxQueueSize = 64,
+};
+
+TEST(InjectQueue, CreateQueue)
+{
+    InjectQueue<int, kMaxQueueSize> queue;
+    ASSERT_EQ(0, queue.size());
+}
+TEST(InjectQueue, PushItem)
+{
+    InjectQueue<int, kMaxQueueSize> queue;
+    ASSERT_EQ(0, queue.push(1234));
+    ASSERT_EQ(1, queue.size());
+}
+TEST(InjectQueue, PushItemFailsWhenQueueIsFull)
+{
+    InjectQueue<int, kMaxQueueSize> queue;
+    for (int ii = 0; ii < kMaxQueueSize; ++ii) {
+        ASSERT_EQ(0, queue.push(ii));
+    }
+    ASSERT_NE(0, queue.push(1234));
+    ASSERT_EQ(kMaxQueueSize, queue.size());
+}
+
+TEST(InjectQueue, PopItemFromEmptyQueueFails)
+{
+    InjectQueue<int, kMaxQueueSize> queue;
+    int value = 0;
+    ASSERT_EQ(0, queue.pop(&value));
+}
+TEST(InjectQueue, PopIsFIFOOrder)
+{
+    InjectQueue<int, kMaxQueueSize> queue;
+    queue.push(1);
+    queue.push(2);
+    queue.push(3);
+    int value = 0;
+    ASSERT_EQ(1, queue.pop(&value));
+    ASSERT_EQ(1, value);
+    ASSERT_EQ(1, queue.pop(&value));
+    ASSERT_EQ(2, value);
+    ASSERT_EQ(1, queue.pop(&value));
+    ASSERT_EQ(3, value);
+    ASSERT_EQ(0, queue.pop(&value));
+}
+TEST(InjectQueue, PopBatchTakesAvailableItems)
+{
+    InjectQueue<int, kMaxQueueSize> queue;
+    queue.push(1);
+    queue.push(2);
+    queue.push(3);
+    int values[8] = {};
+    ASSERT_EQ(2, queue.pop_batch(values, 2));
+    ASSERT_EQ(1, values[0]);
+    ASSERT_EQ(2, values[1]);
+    ASSERT_EQ(1, queue.pop_batch(values, 8));
+    ASSERT_EQ(3, values[0]);
+    ASSERT_EQ(0, queue.size());
+}
+TEST(InjectQueue, QueueWrapsAround)
+{
+    InjectQueue<int, kMaxQueueSize> queue;
+    int value = 0;
+    for (int ii = 0; ii < kMaxQueueSize * 3; ++ii) {
+        ASSERT_EQ(0, queue.push(ii));
+        ASSERT_EQ(1, queue.pop(&value));
+        ASSERT_EQ(ii, value);
+    }
+}
+
+TEST(InjectQueue, ConcurrentProducersAndConsumers)
+{
+    int const kNumThreads = 4;
+    int const kItemsPerThread = 100 * 1000;
+    InjectQueue<int, kMaxQueueSize> queue;
+    std::atomic<int64_t> sum = {0};
+    std::atomic<int> consumed = {0};
+
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < kNumThreads; ++ii) {
+        threads.push_back(std::thread([&]() {
+            for (int jj = 1; jj <= kItemsPerThread; ++jj) {
+                while (queue.push(jj) != 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+        threads.push_back(std::thread([&]() {
+            int values[4];
+            while (consumed.load() < kNumThreads * kItemsPerThread) {
+                int const count = queue.pop_batch(values, 4);
+                for (int jj = 0; jj < count; ++jj) {
+                    sum += values[jj];
+                }
+                consumed += count;
+                if (count == 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    int64_t const expected = (int64_t)kNumThreads * kItemsPerThread * (kItemsPerThread + 1) / 2;
+    ASSERT_EQ(expected, sum.load());
+}
+
+}
@@ -7,9 +7,26 @@
     #include <gtest/gtest.h>
 #endif // #if defined(_MSC_VER)
 #include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #include "task-pool/task-pool.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+    #include <errno.h>
+    #include <stdlib.h>
+    #include <unistd.h>
+    #define HAVE_POSIX_FILES 1
+#endif
+#if defined(__linux__)
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+#endif
+
 namespace {
 
 TEST(TaskPool, CreatePool)
@@ -119,5 +136,1367 @@ TEST_F(TaskPoolTasks, TaskStressTest)
     ASSERT_EQ(0, completion);
     ASSERT_EQ(kTotalTasks, test_int.load());
 }
+TEST_F(TaskPoolTasks, ShardedCompletionStressTest)
+{
+    /* half the tasks are spawned by tasks on the workers, and a foreign
+     * thread injects more, so every shard gets counts */
+    struct FanOut {
+        TaskPool* pool;
+        ShardedCompletion* completion;
+        std::atomic<int> count;
+    };
+    static TaskFunction* const leaf_function = [](int, void* data) {
+        ((FanOut*)data)->count.fetch_add(1);
+    };
+    auto const branch_function = [](int, void* data) {
+        FanOut* fan_out = (FanOut*)data;
+        fan_out->count.fetch_add(1);
+        tpSpawnShardedTask(fan_out->pool, leaf_function, fan_out, fan_out->completion);
+    };
+
+    int const kTotalBranches = 250 * 1000;
+    FanOut fan_out = { pool, tpCreateShardedCompletion(pool), {0} };
+    ASSERT_NE(nullptr, fan_out.completion);
+    std::thread foreign([&]() {
+        for (int ii = 0; ii < 1000; ++ii) {
+            tpSpawnShardedTask(pool, leaf_function, &fan_out, fan_out.completion);
+        }
+    });
+    for (int ii = 0; ii < kTotalBranches; ++ii) {
+        tpSpawnShardedTask(pool, branch_function, &fan_out, fan_out.completion);
+    }
+    foreign.join();
+    tpWaitForShardedCompletion(pool, fan_out.completion);
+    ASSERT_NE(0, tpIsShardedCompletionDone(fan_out.completion));
+    ASSERT_EQ(2 * kTotalBranches + 1000, fan_out.count.load());
+    tpDestroyShardedCompletion(pool, fan_out.completion);
+}
+
+TEST_F(TaskPoolTasks, ParkedWorkersStopIdling)
+{
+    ASSERT_EQ(4, tpNumActiveWorkers(pool));
+    tpSetActiveWorkers(pool, 2);
+    ASSERT_EQ(2, tpNumActiveWorkers(pool));
+    while (tpNumIdleThreads(pool) != 2) {
+        std::this_thread::yield();
+    }
+
+    tpSetActiveWorkers(pool, 4);
+    while (tpNumIdleThreads(pool) != 4) {
+        std::this_thread::yield();
+    }
+}
+TEST_F(TaskPoolTasks, SetActiveWorkersIsClamped)
+{
+    tpSetActiveWorkers(pool, 100);
+    ASSERT_EQ(4, tpNumActiveWorkers(pool));
+    tpSetActiveWorkers(pool, -1);
+    ASSERT_EQ(0, tpNumActiveWorkers(pool));
+}
+TEST_F(TaskPoolTasks, TasksCompleteWithParkedWorkers)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    tpSetActiveWorkers(pool, 1);
+    TaskCompletion completion = 0;
+    std::atomic<int> test_int = {0};
+    for (int ii = 0; ii < 1000; ++ii) {
+        tpSpawnTask(pool, task_function, &test_int, &completion);
+    }
+    tpSetActiveWorkers(pool, 0);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(0, completion);
+    ASSERT_EQ(1000, test_int.load());
+}
+TEST_F(TaskPoolTasks, AutoScaleParksIdleWorkers)
+{
+    AutoScaleInfo const info = { 1, 4, 1, 1 };
+    tpSetAutoScale(pool, &info);
+    while (tpNumActiveWorkers(pool) != 1) {
+        std::this_thread::yield();
+    }
+    tpSetAutoScale(pool, nullptr);
+    ASSERT_EQ(1, tpNumActiveWorkers(pool));
+}
+TEST_F(TaskPoolTasks, AutoScaleActivatesWorkersWhenBusy)
+{
+    struct Blocker {
+        std::atomic<bool> started;
+        std::atomic<bool> release;
+    } blocker = { {false}, {false} };
+    auto const blocking_function = [](int, void* data) {
+        Blocker* blocker = (Blocker*)data;
+        blocker->started = true;
+        while (blocker->release.load() == false) {
+            std::this_thread::yield();
+        }
+    };
+    auto const empty_function = [](int, void*) {};
+
+    tpSetActiveWorkers(pool, 1);
+    AutoScaleInfo const info = { 1, 4, 1000 * 1000, 1 };
+    tpSetAutoScale(pool, &info);
+
+    TaskCompletion completion = 0;
+    tpSpawnTask(pool, blocking_function, &blocker, &completion);
+    while (blocker.started.load() == false) {
+        std::this_thread::yield();
+    }
+    // the only active worker is busy, so a queued task brings back another
+    tpSpawnTask(pool, empty_function, nullptr, &completion);
+    ASSERT_LT(1, tpNumActiveWorkers(pool));
+
+    blocker.release = true;
+    tpWaitForCompletion(pool, &completion);
+    tpSetAutoScale(pool, nullptr);
+}
+
+TEST(TaskPool, CreatePoolWithSpareThreads)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.num_spare_threads = 2;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_NE(nullptr, pool);
+    ASSERT_EQ(5, tpNumThreads(pool));
+    ASSERT_EQ(2, tpNumSpareThreads(pool));
+    ASSERT_EQ(4, tpNumIdleThreads(pool));
+    tpDestroyPool(pool);
+}
+TEST(TaskPool, SpareThreadRunsTasksWhileWorkerBlocks)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 1;
+    info.num_spare_threads = 1;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_NE(nullptr, pool);
+
+    struct Blocker {
+        TaskPool* pool;
+        std::atomic<bool> blocking;
+        std::atomic<int> release_thread;
+    } blocker = { pool, {false}, {-1} };
+    auto const blocking_function = [](int, void* data) {
+        Blocker* blocker = (Blocker*)data;
+        tpBeginBlocking(blocker->pool);
+        blocker->blocking = true;
+        while (blocker->release_thread.load() < 0) {
+            std::this_thread::yield();
+        }
+        tpEndBlocking(blocker->pool);
+    };
+    auto const release_function = [](int thread_id, void* data) {
+        ((Blocker*)data)->release_thread = thread_id;
+    };
+
+    TaskCompletion completion = 0;
+    tpSpawnTask(pool, blocking_function, &blocker, &completion);
+    while (blocker.blocking.load() == false) {
+        std::this_thread::yield();
+    }
+    // the only worker is blocked and this thread doesn't help, so only the
+    // spare can run the releasing task
+    tpSpawnTask(pool, release_function, &blocker, &completion);
+    while (blocker.release_thread.load() < 0) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(2, blocker.release_thread.load());
+    tpWaitForCompletion(pool, &completion);
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, RegisterThreadFailsWithoutSlots)
+{
+    TaskPool* pool = tpCreatePool(1, nullptr);
+    ASSERT_NE(nullptr, pool);
+    int thread_id = 0;
+    std::thread([&]() { thread_id = tpRegisterThread(pool); }).join();
+    ASSERT_EQ(-1, thread_id);
+    tpDestroyPool(pool);
+}
+TEST(TaskPool, RegisterThreadFailsForThreadsWithAnId)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 1;
+    info.max_external_threads = 2;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_NE(nullptr, pool);
+    ASSERT_EQ(-1, tpRegisterThread(pool));
+    int thread_ids[2] = { -1, -1 };
+    std::thread([&]() {
+        thread_ids[0] = tpRegisterThread(pool);
+        thread_ids[1] = tpRegisterThread(pool);
+        tpUnregisterThread(pool);
+    }).join();
+    ASSERT_EQ(2, thread_ids[0]);
+    ASSERT_EQ(-1, thread_ids[1]);
+    tpDestroyPool(pool);
+}
+TEST(TaskPool, ExternalThreadsSpawnIntoTheirOwnQueues)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.max_external_threads = 8;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_NE(nullptr, pool);
+
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    int const kTasksPerThread = 10 * 1000;
+    std::atomic<int> test_int = {0};
+    std::vector<int> thread_ids(8, -1);
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < 8; ++ii) {
+        threads.push_back(std::thread([&, ii]() {
+            thread_ids[ii] = tpRegisterThread(pool);
+            TaskCompletion completion = 0;
+            for (int jj = 0; jj < kTasksPerThread; ++jj) {
+                tpSpawnTask(pool, task_function, &test_int, &completion);
+            }
+            tpWaitForCompletion(pool, &completion);
+            tpUnregisterThread(pool);
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (int ii = 0; ii < 8; ++ii) {
+        ASSERT_LE(5, thread_ids[ii]);
+    }
+    ASSERT_EQ(8 * kTasksPerThread, test_int.load());
+    tpDestroyPool(pool);
+}
+
+TEST_F(TaskPoolTasks, InjectTasksFromForeignThreads)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    int const kTasksPerThread = 10 * 1000;
+    TaskCompletion completion = 0;
+    std::atomic<int> test_int = {0};
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < 4; ++ii) {
+        threads.push_back(std::thread([&]() {
+            for (int jj = 0; jj < kTasksPerThread; ++jj) {
+                tpInjectTask(pool, task_function, &test_int, &completion);
+            }
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(0, completion);
+    ASSERT_EQ(4 * kTasksPerThread, test_int.load());
+}
+TEST_F(TaskPoolTasks, FinishAllWorkWaitsForTasksSpawnedByTasks)
+{
+    /* each task spawns the next link of its chain on whichever worker runs
+     * it, without a completion, so only the pool's own counts know about
+     * them. Foreign threads start half the chains */
+    struct Chain {
+        TaskPool* pool;
+        std::atomic<int>* count;
+    };
+    static TaskFunction* const link_function = [](int, void* data) {
+        Chain* chain = (Chain*)data;
+        if (chain->count->fetch_add(1) % 100 != 99) {
+            tpSpawnTask(chain->pool, link_function, chain, nullptr);
+        }
+    };
+
+    for (int round = 0; round < 20; ++round) {
+        std::atomic<int> counts[8];
+        Chain chains[8];
+        for (int ii = 0; ii < 8; ++ii) {
+            counts[ii] = 0;
+            chains[ii] = { pool, &counts[ii] };
+        }
+        std::thread foreign([&]() {
+            for (int ii = 0; ii < 4; ++ii) {
+                tpInjectTask(pool, link_function, &chains[ii], nullptr);
+            }
+        });
+        for (int ii = 4; ii < 8; ++ii) {
+            tpSpawnTask(pool, link_function, &chains[ii], nullptr);
+        }
+        foreign.join();
+        tpFinishAllWork(pool);
+        for (int ii = 0; ii < 8; ++ii) {
+            ASSERT_EQ(100, counts[ii].load());
+        }
+    }
+}
+
+TEST(TaskPool, MultiplePoolsRunIndependently)
+{
+    TaskPool* compute_pool = tpCreatePool(2, nullptr);
+    TaskPool* io_pool = tpCreatePool(3, nullptr);
+    ASSERT_NE(nullptr, compute_pool);
+    ASSERT_NE(nullptr, io_pool);
+
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    TaskCompletion compute_completion = 0;
+    TaskCompletion io_completion = 0;
+    std::atomic<int> test_int = {0};
+    for (int ii = 0; ii < 1000; ++ii) {
+        tpSpawnTask(compute_pool, task_function, &test_int, &compute_completion);
+        tpSpawnTask(io_pool, task_function, &test_int, &io_completion);
+    }
+    tpWaitForCompletion(compute_pool, &compute_completion);
+    tpWaitForCompletion(io_pool, &io_completion);
+    ASSERT_EQ(2000, test_int.load());
+
+    tpDestroyPool(io_pool);
+    tpDestroyPool(compute_pool);
+}
+TEST(TaskPool, WorkersSpawnIntoOtherPools)
+{
+    struct Pools {
+        TaskPool* compute_pool;
+        TaskPool* io_pool;
+        std::atomic<int> num_tasks;
+        std::atomic<int> max_thread_id;
+
+        static void IoFunction(int thread_id, void* data)
+        {
+            Pools* pools = (Pools*)data;
+            pools->num_tasks++;
+            int max_thread_id = pools->max_thread_id.load();
+            while (thread_id > max_thread_id &&
+                   !pools->max_thread_id.compare_exchange_weak(max_thread_id, thread_id)) {
+            }
+        }
+    } pools = { tpCreatePool(2, nullptr), tpCreatePool(3, nullptr), {0}, {0} };
+
+    auto const compute_function = [](int, void* data) {
+        Pools* pools = (Pools*)data;
+        TaskCompletion completion = 0;
+        for (int ii = 0; ii < 100; ++ii) {
+            tpSpawnTask(pools->io_pool, Pools::IoFunction, pools, &completion);
+        }
+        tpWaitForCompletion(pools->io_pool, &completion);
+    };
+
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 10; ++ii) {
+        tpSpawnTask(pools.compute_pool, compute_function, &pools, &completion);
+    }
+    tpWaitForCompletion(pools.compute_pool, &completion);
+    ASSERT_EQ(1000, pools.num_tasks.load());
+    ASSERT_GT(tpNumThreads(pools.io_pool), pools.max_thread_id.load());
+
+    tpDestroyPool(pools.io_pool);
+    tpDestroyPool(pools.compute_pool);
+}
+TEST(TaskPool, NewPoolDoesNotReuseStaleThreadIds)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 2;
+    info.max_external_threads = 1;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    tpDestroyPool(pool);
+
+    // another thread owns the new pool, so this thread has no queue in it
+    // even if the pool landed at the old address
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+    std::thread([&]() { pool = tpCreatePoolWithInfo(&info); }).join();
+    TaskCompletion completion = 0;
+    std::atomic<int> test_int = {0};
+    tpSpawnTask(pool, task_function, &test_int, &completion);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(1, test_int.load());
+    ASSERT_EQ(3, tpRegisterThread(pool));
+    tpUnregisterThread(pool);
+    tpDestroyPool(pool);
+}
+
+TEST_F(TaskPoolTasks, CancelledTasksAreSkipped)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    int const kTotalTasks = 100 * 1000;
+    TaskCancellation cancellation = 0;
+    TaskCompletion completion = 0;
+    std::atomic<int> test_int = {0};
+    tpCancel(&cancellation);
+    for (int ii = 0; ii < kTotalTasks; ++ii) {
+        tpSpawnCancellableTask(pool, task_function, &test_int, &completion, &cancellation);
+    }
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(0, completion);
+    ASSERT_EQ(0, test_int.load());
+}
+TEST_F(TaskPoolTasks, CancellingSkipsQueuedTasks)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    // nobody runs tasks until this thread waits
+    tpSetActiveWorkers(pool, 0);
+    TaskCancellation cancellation = 0;
+    TaskCompletion completion = 0;
+    std::atomic<int> test_int = {0};
+    for (int ii = 0; ii < 1000; ++ii) {
+        tpSpawnCancellableTask(pool, task_function, &test_int, &completion, &cancellation);
+    }
+    tpSpawnTask(pool, task_function, &test_int, &completion);
+    tpCancel(&cancellation);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(0, completion);
+    ASSERT_EQ(1, test_int.load());
+}
+TEST_F(TaskPoolTasks, RunningTasksCanPollForCancellation)
+{
+    struct Poller {
+        std::atomic<bool> started;
+        std::atomic<bool> saw_cancel;
+    } poller = { {false}, {false} };
+    auto const polling_function = [](int, void* data) {
+        Poller* poller = (Poller*)data;
+        poller->started = true;
+        while (!tpIsCancelled()) {
+            std::this_thread::yield();
+        }
+        poller->saw_cancel = true;
+    };
+
+    TaskCancellation cancellation = 0;
+    TaskCompletion completion = 0;
+    tpSpawnCancellableTask(pool, polling_function, &poller, &completion, &cancellation);
+    while (poller.started.load() == false) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(0, tpIsCancelled());
+    tpCancel(&cancellation);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_TRUE(poller.saw_cancel.load());
+}
+
+
+TEST_F(TaskPoolTasks, DelayedTaskRunsAfterItsDelay)
+{
+    auto const record_time = [](int, void* data) {
+        *(std::atomic<uint64_t>*)data = tpGetTime();
+    };
+
+    uint64_t const kDelayUs = 20 * 1000;
+    std::atomic<uint64_t> run_time = {0};
+    TaskCompletion completion = 0;
+    uint64_t const start_time = tpGetTime();
+    tpSpawnTaskAfterDelay(pool, kDelayUs, record_time, &run_time, &completion);
+    ASSERT_EQ(1, completion);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_GE(run_time.load(), start_time + kDelayUs);
+}
+TEST_F(TaskPoolTasks, FinishAllWorkWaitsForTimedTasks)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    std::atomic<int> test_int = {0};
+    tpSpawnTaskAt(pool, tpGetTime() + 10 * 1000, task_function, &test_int, nullptr);
+    tpSpawnTaskAt(pool, 0, task_function, &test_int, nullptr);
+    tpFinishAllWork(pool);
+    ASSERT_EQ(2, test_int.load());
+}
+TEST_F(TaskPoolTasks, PeriodicTaskRunsUntilCancelled)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    std::atomic<int> test_int = {0};
+    TaskCancellation cancellation = 0;
+    TaskCompletion completion = 0;
+    tpSpawnPeriodicTask(pool, 2 * 1000, task_function, &test_int, &completion, &cancellation);
+    while (test_int.load() < 5) {
+        tpRunPendingTask(pool);
+        std::this_thread::yield();
+    }
+    tpCancel(&cancellation);
+    tpWaitForCompletion(pool, &completion);
+    int const num_runs = test_int.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    tpFinishAllWork(pool);
+    ASSERT_EQ(num_runs, test_int.load());
+}
+TEST_F(TaskPoolTasks, ThousandsOfTimersFireOnTime)
+{
+    struct Timed {
+        uint64_t            deadline;
+        std::atomic<int>*   num_early;
+    };
+    auto const check_time = [](int, void* data) {
+        Timed const* timed = (Timed const*)data;
+        if (tpGetTime() < timed->deadline) {
+            timed->num_early->fetch_add(1);
+        }
+    };
+
+    int const kNumTimers = 10 * 1000;
+    std::atomic<int> num_early = {0};
+    std::vector<Timed> timed(kNumTimers);
+    TaskCompletion completion = 0;
+    uint64_t const start_time = tpGetTime();
+    for (int ii = 0; ii < kNumTimers; ++ii) {
+        // spread over 100ms, crossing a few level 0 wrap-arounds
+        timed[ii].deadline = start_time + (uint64_t)(ii * 7919 % kNumTimers) * 10;
+        timed[ii].num_early = &num_early;
+        tpSpawnTaskAt(pool, timed[ii].deadline, check_time, &timed[ii], &completion);
+    }
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(0, completion);
+    ASSERT_EQ(0, num_early.load());
+}
+
+
+/* a task tree that records the order tasks run in and their thread ids.
+ * Levels alternate between waiting for their children and running pending
+ * tasks until they are done */
+struct TraceNode {
+    std::vector<int>*   trace;
+    std::atomic<int>*   num_running;
+    std::atomic<int>*   max_running;
+    TaskPool*           pool;
+    int                 id;
+    int                 depth;
+};
+void _TraceTask(int thread_id, void* data)
+{
+    TraceNode const* node = (TraceNode const*)data;
+    int const running = ++*node->num_running;
+    if (running > node->max_running->load()) {
+        node->max_running->store(running);
+    }
+    node->trace->push_back(node->id);
+    node->trace->push_back(thread_id);
+    --*node->num_running;
+    if (node->depth == 0) {
+        return;
+    }
+    TraceNode* children = new TraceNode[3];
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 3; ++ii) {
+        children[ii] = *node;
+        children[ii].id = node->id * 3 + ii + 1;
+        children[ii].depth = node->depth - 1;
+        tpSpawnTask(node->pool, _TraceTask, &children[ii], &completion);
+    }
+    if (node->depth % 2 == 0) {
+        tpWaitForCompletion(node->pool, &completion);
+    } else {
+        while (completion) {
+            tpRunPendingTask(node->pool);
+        }
+    }
+    delete[] children;
+}
+
+std::vector<int> _RunSeededTrace(uint64_t seed, int* max_running)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.deterministic = 1;
+    info.seed = seed;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    std::vector<int> trace;
+    std::atomic<int> num_running = {0};
+    std::atomic<int> max_running_tasks = {0};
+    std::vector<TraceNode> roots(8);
+    for (int ii = 0; ii < (int)roots.size(); ++ii) {
+        TraceNode const root = { &trace, &num_running, &max_running_tasks, pool, ii * 1000, 4 };
+        roots[ii] = root;
+    }
+    // spawned from a task, since the workers start on the first spawn from
+    // outside right away
+    tpSpawnTask(pool, [](int, void* data) {
+        std::vector<TraceNode>& roots = *(std::vector<TraceNode>*)data;
+        for (TraceNode& root : roots) {
+            tpSpawnTask(root.pool, _TraceTask, &root, nullptr);
+        }
+    }, &roots, nullptr);
+    tpFinishAllWork(pool);
+    tpDestroyPool(pool);
+    *max_running = max_running_tasks.load();
+    return trace;
+}
+
+TEST(TaskPool, SameSeedGivesSameSchedule)
+{
+    int max_running = 0;
+    std::vector<int> const trace = _RunSeededTrace(1234, &max_running);
+    ASSERT_EQ(1, max_running);
+    ASSERT_EQ(8u * (1 + 3 + 9 + 27 + 81) * 2, trace.size());
+    ASSERT_EQ(trace, _RunSeededTrace(1234, &max_running));
+    ASSERT_NE(trace, _RunSeededTrace(4321, &max_running));
+
+    // the workers run the tasks, the creating thread only waits
+    for (size_t ii = 1; ii < trace.size(); ii += 2) {
+        ASSERT_GE(trace[ii], 1);
+        ASSERT_LT(trace[ii], 5);
+    }
+}
+
+TEST(TaskPool, SeededPoolsRunTasksWithoutWaiters)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.deterministic = 1;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    struct Ran {
+        std::atomic<int> count;
+        std::atomic<bool> by_worker[5];
+    } ran;
+    ran.count = 0;
+    for (std::atomic<bool>& by_worker : ran.by_worker) {
+        by_worker = false;
+    }
+    for (int ii = 0; ii < 100; ++ii) {
+        tpSpawnTask(pool, [](int thread_id, void* data) {
+            ((Ran*)data)->by_worker[thread_id] = true;
+            ((Ran*)data)->count++;
+        }, &ran, nullptr);
+    }
+    // nobody waits on the pool, the workers take turns running the tasks
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (ran.count.load() != 100 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(100, ran.count.load());
+    ASSERT_FALSE(ran.by_worker[0].load());
+    int num_workers = 0;
+    for (std::atomic<bool> const& by_worker : ran.by_worker) {
+        num_workers += by_worker.load() ? 1 : 0;
+    }
+    ASSERT_LT(1, num_workers);
+    tpDestroyPool(pool);
+}
+
+/* every task spawns four more down to depth 0, so the workers keep popping
+ * their own queues while the others steal from them. Returns how many ran */
+int _RunTaskTree(TaskPool* pool, int depth)
+{
+    struct Node {
+        TaskPool* pool;
+        std::atomic<int>* count;
+        int depth;
+    };
+    static TaskFunction* const node_function = [](int, void* data) {
+        Node* node = (Node*)data;
+        node->count->fetch_add(1);
+        if (node->depth > 0) {
+            Node children[4];
+            TaskCompletion completion = 0;
+            for (int ii = 0; ii < 4; ++ii) {
+                children[ii] = { node->pool, node->count, node->depth - 1 };
+                tpSpawnTask(node->pool, node_function, &children[ii], &completion);
+            }
+            tpWaitForCompletion(node->pool, &completion);
+        }
+    };
+
+    std::atomic<int> count = {0};
+    Node root = { pool, &count, depth };
+    TaskCompletion completion = 0;
+    tpSpawnTask(pool, node_function, &root, &completion);
+    tpWaitForCompletion(pool, &completion);
+    return count.load();
+}
+
+TEST(TaskPool, AsymmetricFencesRunEveryTask)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.asymmetric_fences = 1;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_NE(nullptr, pool);
+
+    TaskPool* default_pool = tpCreatePool(1, nullptr);
+    ASSERT_EQ(0, tpUsesAsymmetricFences(default_pool));
+    tpDestroyPool(default_pool);
+
+    for (int ii = 0; ii < 20; ++ii) {
+        ASSERT_EQ(1 + 4 + 16 + 64 + 256 + 1024, _RunTaskTree(pool, 5));
+    }
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, PerCpuQueuesRunEveryTask)
+{
+    // more threads than CPUs, and threads the pool didn't create spawning too
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 2 * (int)std::thread::hardware_concurrency() + 2;
+    info.max_external_threads = 4;
+    info.per_cpu_queues = 1;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_NE(nullptr, pool);
+#if defined(__linux__)
+    ASSERT_LT(0, tpNumCpuQueues(pool));
+#endif
+
+    std::vector<std::thread> threads;
+    std::atomic<int> failures = {0};
+    for (int ii = 0; ii < 4; ++ii) {
+        threads.push_back(std::thread([pool, &failures]() {
+            tpRegisterThread(pool);
+            for (int jj = 0; jj < 10; ++jj) {
+                if (_RunTaskTree(pool, 4) != 1 + 4 + 16 + 64 + 256) {
+                    failures++;
+                }
+            }
+            tpUnregisterThread(pool);
+        }));
+    }
+    for (int ii = 0; ii < 10; ++ii) {
+        ASSERT_EQ(1 + 4 + 16 + 64 + 256 + 1024, _RunTaskTree(pool, 5));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQ(0, failures.load());
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, EverySchedulerPolicyRunsEveryTask)
+{
+    for (int policies = 0; policies < 16; ++policies) {
+        TaskPoolCreateInfo info = {};
+        info.num_threads = 4;
+        info.victim_policy = (policies & 1) ? kVictimRandom : kVictimRoundRobin;
+        info.idle_policy = (policies & 2) ? kIdleSpin : kIdleSleep;
+        info.wake_policy = (policies & 4) ? kWakeOne : kWakeAll;
+        info.per_cpu_queues = (policies & 8) ? 1 : 0;
+        TaskPool* pool = tpCreatePoolWithInfo(&info);
+        ASSERT_NE(nullptr, pool);
+        for (int ii = 0; ii < 5; ++ii) {
+            ASSERT_EQ(1 + 4 + 16 + 64 + 256, _RunTaskTree(pool, 4));
+        }
+        tpDestroyPool(pool);
+    }
+}
+
+TEST(TaskPool, SchedulerCallbacksAreCalled)
+{
+    struct Calls {
+        std::atomic<int> victims;
+        std::atomic<int> spins;
+    } calls = { {0}, {0} };
+    SchedulerCallbacks callbacks;
+    callbacks.select_victim = [](void* user_data, int thread_id, int num_slots, int attempt) {
+        ((Calls*)user_data)->victims++;
+        return (thread_id + num_slots - 1 - attempt) % num_slots;
+    };
+    callbacks.keep_spinning = [](void* user_data, int, int idle_rounds) {
+        ((Calls*)user_data)->spins++;
+        return idle_rounds < 4 ? 1 : 0;
+    };
+    callbacks.user_data = &calls;
+
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.scheduler_callbacks = &callbacks;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    for (int ii = 0; ii < 5; ++ii) {
+        ASSERT_EQ(1 + 4 + 16 + 64 + 256, _RunTaskTree(pool, 4));
+    }
+    tpDestroyPool(pool);
+    ASSERT_LT(0, calls.victims.load());
+    ASSERT_LT(0, calls.spins.load());
+}
+TEST(TaskPool, WorkersThatNeverSleepStillStart)
+{
+    SchedulerCallbacks callbacks = {};
+    callbacks.keep_spinning = [](void*, int, int) {
+        return 1;
+    };
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.scheduler_callbacks = &callbacks;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_NE(nullptr, pool);
+    ASSERT_EQ(1 + 4 + 16 + 64, _RunTaskTree(pool, 3));
+    ASSERT_EQ(0, tpNumIdleThreads(pool));
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, WaitRunsItsOwnTasksFirst)
+{
+    // without workers the queue order decides, and the awaited task is the
+    // oldest one
+    TaskPool* pool = tpCreatePool(0, nullptr);
+    auto const count_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+    std::atomic<int> awaited = {0};
+    std::atomic<int> unrelated = {0};
+    TaskCompletion completion = 0;
+    tpSpawnTask(pool, count_function, &awaited, &completion);
+    for (int ii = 0; ii < 10; ++ii) {
+        tpSpawnTask(pool, count_function, &unrelated, nullptr);
+    }
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(1, awaited.load());
+    ASSERT_EQ(0, unrelated.load());
+    tpFinishAllWork(pool);
+    ASSERT_EQ(10, unrelated.load());
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, DeepWaitChainsFinish)
+{
+    /* every link spawns the next one and waits for it. Eight chains run at
+     * once, so waiters that took any task would stack up links of the other
+     * chains on top of their own */
+    struct Link {
+        TaskPool* pool;
+        std::atomic<int>* count;
+        int depth;
+    };
+    static TaskFunction* const link_function = [](int, void* data) {
+        Link const* link = (Link const*)data;
+        link->count->fetch_add(1);
+        if (link->depth == 0) {
+            return;
+        }
+        Link next = { link->pool, link->count, link->depth - 1 };
+        TaskCompletion completion = 0;
+        tpSpawnTask(link->pool, link_function, &next, &completion);
+        tpWaitForCompletion(link->pool, &completion);
+    };
+    TaskPool* pool = tpCreatePool(4, nullptr);
+    std::atomic<int> count = {0};
+    Link roots[8];
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 8; ++ii) {
+        roots[ii] = { pool, &count, 200 };
+        tpSpawnTask(pool, link_function, &roots[ii], &completion);
+    }
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(8 * 201, count.load());
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, DeepQueuesRunSpawnsInline)
+{
+    // without workers nobody is ever idle
+    TaskPool* pool = tpCreatePool(0, nullptr);
+    auto const count_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+    InlineSpawnInfo const info = { 4, 8 };
+    tpSetInlineSpawn(pool, &info);
+
+    std::atomic<int> count = {0};
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 10; ++ii) {
+        tpSpawnTask(pool, count_function, &count, &completion);
+    }
+    ASSERT_EQ(6, count.load());
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(10, count.load());
+
+    tpSetInlineSpawn(pool, nullptr);
+    tpSpawnTask(pool, count_function, &count, &completion);
+    ASSERT_EQ(10, count.load());
+    tpWaitForCompletion(pool, &completion);
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, InlineSpawnsNestBoundedly)
+{
+    struct Chain {
+        TaskPool* pool;
+        TaskCompletion* completion;
+        std::atomic<int> count;
+        int depth; // frames of link_function on the stack
+        int max_depth;
+    };
+    static TaskFunction* const link_function = [](int, void* data) {
+        Chain* chain = (Chain*)data;
+        chain->depth++;
+        chain->max_depth = chain->depth > chain->max_depth ? chain->depth : chain->max_depth;
+        if (chain->count.fetch_add(1) < 100) {
+            tpSpawnTask(chain->pool, link_function, chain, chain->completion);
+        }
+        chain->depth--;
+    };
+    TaskPool* pool = tpCreatePool(0, nullptr);
+    InlineSpawnInfo const info = { 0, 3 };
+    tpSetInlineSpawn(pool, &info);
+
+    TaskCompletion completion = 0;
+    Chain chain = { pool, &completion, {0}, 0, 0 };
+    tpSpawnTask(pool, link_function, &chain, &completion);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(101, chain.count.load());
+    // a queued link plus the inline ones it nests
+    ASSERT_EQ(1 + 3, chain.max_depth);
+    tpDestroyPool(pool);
+}
+
+/* a pool without workers that lets four tasks be in flight, so every spawn
+ * after the fourth goes through the admission policy */
+TaskPool* _CreateCappedPool(int admission_policy)
+{
+    TaskPoolCreateInfo info = {};
+    info.admission_policy = admission_policy;
+    info.max_tasks_in_flight = 4;
+    return tpCreatePoolWithInfo(&info);
+}
+void _CountTask(int, void* data)
+{
+    ((std::atomic<int>*)data)->fetch_add(1);
+}
+
+TEST(TaskPool, TrySpawnFailsAtTheInFlightLimit)
+{
+    TaskPool* pool = _CreateCappedPool(kAdmitBlock);
+    std::atomic<int> count = {0};
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 4; ++ii) {
+        ASSERT_EQ(0, tpTrySpawnTask(pool, _CountTask, &count, &completion));
+    }
+    ASSERT_EQ(-1, tpTrySpawnTask(pool, _CountTask, &count, &completion));
+    ASSERT_EQ(4, completion);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(0, tpTrySpawnTask(pool, _CountTask, &count, &completion));
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(5, count.load());
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, BlockingAdmissionRunsTasksUntilThereIsRoom)
+{
+    TaskPool* pool = _CreateCappedPool(kAdmitBlock);
+    std::atomic<int> count = {0};
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 10; ++ii) {
+        tpSpawnTask(pool, _CountTask, &count, &completion);
+    }
+    // each spawn past the fourth made room by running one task
+    ASSERT_EQ(6, count.load());
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(10, count.load());
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, InlineAdmissionRunsTasksRightAway)
+{
+    TaskPool* pool = _CreateCappedPool(kAdmitInline);
+    std::atomic<int> count = {0};
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 10; ++ii) {
+        tpSpawnTask(pool, _CountTask, &count, &completion);
+    }
+    ASSERT_EQ(6, count.load());
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(10, count.load());
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, SpillAdmissionQueuesEveryTask)
+{
+    TaskPool* pool = _CreateCappedPool(kAdmitSpill);
+    std::atomic<int> count = {0};
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < 10; ++ii) {
+        tpSpawnTask(pool, _CountTask, &count, &completion);
+    }
+    ASSERT_EQ(0, count.load());
+    ASSERT_EQ(10, completion);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(10, count.load());
+    tpDestroyPool(pool);
+}
+
+TEST(TaskPool, AdmissionPoliciesHoldUpUnderOverload)
+{
+    /* more tasks than fit in a thread's storage, from the workers and from a
+     * foreign thread, against a small in-flight limit */
+    struct FanOut {
+        TaskPool* pool;
+        TaskCompletion* completion;
+        std::atomic<int> count;
+    };
+    static TaskFunction* const leaf_function = [](int, void* data) {
+        ((FanOut*)data)->count.fetch_add(1);
+    };
+    auto const branch_function = [](int, void* data) {
+        FanOut* fan_out = (FanOut*)data;
+        fan_out->count.fetch_add(1);
+        for (int ii = 0; ii < 4; ++ii) {
+            tpSpawnTask(fan_out->pool, leaf_function, fan_out, fan_out->completion);
+        }
+    };
+
+    int const policies[] = { kAdmitBlock, kAdmitInline, kAdmitSpill };
+    for (int policy : policies) {
+        TaskPoolCreateInfo info = {};
+        info.num_threads = 4;
+        info.admission_policy = policy;
+        info.max_tasks_in_flight = 64;
+        TaskPool* pool = tpCreatePoolWithInfo(&info);
+
+        TaskCompletion completion = 0;
+        FanOut fan_out = { pool, &completion, {0} };
+        std::thread foreign([&]() {
+            for (int ii = 0; ii < 2000; ++ii) {
+                tpInjectTask(pool, leaf_function, &fan_out, &completion);
+            }
+        });
+        for (int ii = 0; ii < 5000; ++ii) {
+            tpSpawnTask(pool, branch_function, &fan_out, &completion);
+        }
+        foreign.join();
+        tpWaitForCompletion(pool, &completion);
+        ASSERT_EQ(5 * 5000 + 2000, fan_out.count.load());
+        tpDestroyPool(pool);
+    }
+}
+
+TEST(TaskPool, ForkRunsOneHalfRightAway)
+{
+    // without workers nothing runs the queued half before the wait
+    TaskPoolCreateInfo info = {};
+    info.spawn_policy = kSpawnWorkFirst;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    ASSERT_EQ(kSpawnWorkFirst, tpGetSpawnPolicy(pool));
+
+    std::atomic<int> child = {0};
+    std::atomic<int> continuation = {0};
+    TaskCompletion completion = 0;
+    tpForkTask(pool, _CountTask, &child, _CountTask, &continuation, &completion);
+    ASSERT_EQ(1, child.load());
+    ASSERT_EQ(0, continuation.load());
+    ASSERT_EQ(1, completion);
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(1, continuation.load());
+
+    tpForkTaskWithPolicy(pool, _CountTask, &child, _CountTask, &continuation, &completion,
+                         kSpawnHelpFirst);
+    ASSERT_EQ(1, child.load());
+    ASSERT_EQ(2, continuation.load());
+    tpWaitForCompletion(pool, &completion);
+    ASSERT_EQ(2, child.load());
+    tpDestroyPool(pool);
+}
+
+#if defined(HAVE_POSIX_FILES)
+/* a file filled with a known pattern, on tmpfs where there is one */
+struct PatternFile {
+    enum {
+        kSize = 256 * 1024,
+    };
+    static uint8_t Byte(size_t offset) { return (uint8_t)(offset * 131 + 7); }
+
+    PatternFile()
+    {
+        char shm_path[] = "/dev/shm/task-pool-test-XXXXXX";
+        char tmp_path[] = "/tmp/task-pool-test-XXXXXX";
+        fd = mkstemp(shm_path);
+        char const* path = shm_path;
+        if (fd < 0) {
+            fd = mkstemp(tmp_path);
+            path = tmp_path;
+        }
+        if (fd >= 0) {
+            unlink(path);
+            std::vector<uint8_t> data(kSize);
+            for (size_t ii = 0; ii < data.size(); ++ii) {
+                data[ii] = Byte(ii);
+            }
+            if (write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    ~PatternFile()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int fd = -1;
+};
+
+struct AsyncRead {
+    std::vector<uint8_t>    buffer;
+    uint64_t                offset;
+    std::atomic<int64_t>    result;
+    std::atomic<int>        num_calls;
+};
+void _RecordRead(int, void* data, int64_t result)
+{
+    AsyncRead* read = (AsyncRead*)data;
+    read->result = result;
+    read->num_calls++;
+}
+
+/* reads the file in chunks, more of them than fit into the ring at once */
+void _ReadPatternFile(TaskPool* pool)
+{
+    PatternFile file;
+    ASSERT_GE(file.fd, 0);
+    int const kChunkSize = 512;
+    int const kNumReads = PatternFile::kSize / kChunkSize;
+    std::vector<AsyncRead> reads(kNumReads);
+    TaskCompletion completion = 0;
+    for (int ii = 0; ii < kNumReads; ++ii) {
+        AsyncRead& read = reads[ii];
+        read.buffer.resize(kChunkSize);
+        read.offset = (uint64_t)((ii * 7919) % kNumReads) * kChunkSize;
+        read.result = 0;
+        read.num_calls = 0;
+        tpReadAsync(pool, file.fd, read.buffer.data(), kChunkSize, read.offset,
+                    _RecordRead, &read, &completion);
+    }
+    tpWaitForCompletion(pool, &completion);
+    for (AsyncRead& read : reads) {
+        ASSERT_EQ(1, read.num_calls.load());
+        ASSERT_EQ(kChunkSize, read.result.load());
+        for (int ii = 0; ii < kChunkSize; ++ii) {
+            ASSERT_EQ(PatternFile::Byte(read.offset + ii), read.buffer[ii]);
+        }
+    }
+
+    // reads past the end and of bad files report through the result
+    AsyncRead past_end;
+    past_end.buffer.resize(kChunkSize);
+    past_end.result = -1;
+    past_end.num_calls = 0;
+    tpReadAsync(pool, file.fd, past_end.buffer.data(), kChunkSize, PatternFile::kSize,
+                _RecordRead, &past_end, &completion);
+    AsyncRead bad_file;
+    bad_file.buffer.resize(kChunkSize);
+    bad_file.result = 0;
+    bad_file.num_calls = 0;
+    tpReadAsync(pool, -1, bad_file.buffer.data(), kChunkSize, 0,
+                _RecordRead, &bad_file, &completion);
+    tpFinishAllWork(pool);
+    ASSERT_EQ(0, completion);
+    ASSERT_EQ(0, past_end.result.load());
+    ASSERT_EQ(-EBADF, bad_file.result.load());
+}
+
+TEST_F(TaskPoolTasks, ReadAsyncCompletesIntoTasks)
+{
+    _ReadPatternFile(pool);
+}
+TEST(TaskPool, ReadAsyncFallsBackToHelperThread)
+{
+    TaskPoolCreateInfo info = {};
+    info.num_threads = 4;
+    info.disable_io_uring = 1;
+    TaskPool* pool = tpCreatePoolWithInfo(&info);
+    _ReadPatternFile(pool);
+    tpDestroyPool(pool);
+}
+TEST(TaskPool, ReadAsyncWithoutWorkers)
+{
+    TaskPool* pool = tpCreatePool(0, nullptr);
+    _ReadPatternFile(pool);
+    tpDestroyPool(pool);
+}
+#endif // defined(HAVE_POSIX_FILES)
+
+
+#if defined(__linux__)
+/* a connected pair of TCP sockets on the loopback interface */
+struct LoopbackConnection {
+    LoopbackConnection()
+    {
+        int const listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(listener, (sockaddr*)&address, length) == 0 &&
+            listen(listener, 1) == 0 &&
+            getsockname(listener, (sockaddr*)&address, &length) == 0) {
+            client = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(client, (sockaddr*)&address, length) == 0) {
+                server = accept(listener, nullptr, nullptr);
+            }
+        }
+        close(listener);
+        int const no_delay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    }
+    ~LoopbackConnection()
+    {
+        close(client);
+        close(server);
+    }
+
+    int client = -1;
+    int server = -1;
+};
+
+struct FdEvents {
+    std::atomic<int>    num_calls;
+    std::atomic<int>    events;
+};
+void _RecordFdEvents(int, void* data, int events)
+{
+    FdEvents* fd_events = (FdEvents*)data;
+    fd_events->events = events;
+    fd_events->num_calls++;
+}
+
+TEST_F(TaskPoolTasks, WatchedFdSpawnsTaskWhenReady)
+{
+    LoopbackConnection connection;
+    ASSERT_GE(connection.server, 0);
+    FdEvents readable = { {0}, {0} };
+    ASSERT_EQ(0, tpWatchFd(pool, connection.server, kWatchRead, _RecordFdEvents, &readable));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_EQ(0, readable.num_calls.load());
+
+    char const message = 'x';
+    ASSERT_EQ(1, write(connection.client, &message, 1));
+    while (readable.num_calls.load() == 0) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(kWatchRead, readable.events.load());
+
+    // watches are one-shot
+    ASSERT_EQ(1, write(connection.client, &message, 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    tpFinishAllWork(pool);
+    ASSERT_EQ(1, readable.num_calls.load());
+}
+TEST_F(TaskPoolTasks, UnwatchedFdDoesNotSpawn)
+{
+    LoopbackConnection connection;
+    ASSERT_GE(connection.server, 0);
+    FdEvents readable = { {0}, {0} };
+    ASSERT_EQ(0, tpWatchFd(pool, connection.server, kWatchRead, _RecordFdEvents, &readable));
+    tpUnwatchFd(pool, connection.server);
+    char const message = 'x';
+    ASSERT_EQ(1, write(connection.client, &message, 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    tpFinishAllWork(pool);
+    ASSERT_EQ(0, readable.num_calls.load());
+}
+TEST_F(TaskPoolTasks, WatchingInvalidFdFails)
+{
+    FdEvents events = { {0}, {0} };
+    ASSERT_EQ(-EBADF, tpWatchFd(pool, -1, kWatchRead, _RecordFdEvents, &events));
+}
+
+/* echoes every byte back and watches again, like an RPC server would */
+struct EchoServer {
+    TaskPool*           pool;
+    int                 fd;
+    std::atomic<int>    num_requests;
+};
+void _Echo(int, void* data, int events)
+{
+    EchoServer* server = (EchoServer*)data;
+    char buffer[64];
+    ssize_t const count = read(server->fd, buffer, sizeof(buffer));
+    if (count > 0 && (events & kWatchRead)) {
+        server->num_requests++;
+        ssize_t const written = write(server->fd, buffer, (size_t)count);
+        (void)written;
+    }
+    tpWatchFd(server->pool, server->fd, kWatchRead, _Echo, server);
+}
+
+TEST(TaskPool, WatchedFdsDriveRequestsWhileWorkersSleep)
+{
+    TaskPool* pool = tpCreatePool(2, nullptr);
+    LoopbackConnection connection;
+    ASSERT_GE(connection.server, 0);
+    EchoServer server = { pool, connection.server, {0} };
+    ASSERT_EQ(0, tpWatchFd(pool, connection.server, kWatchRead, _Echo, &server));
+
+    int const kNumRequests = 1000;
+    for (int ii = 0; ii < kNumRequests; ++ii) {
+        // this thread blocks in read, so only the workers can answer
+        char const request = (char)ii;
+        char response = 0;
+        ASSERT_EQ(1, write(connection.client, &request, 1));
+        ASSERT_EQ(1, read(connection.client, &response, 1));
+        ASSERT_EQ(request, response);
+    }
+    ASSERT_EQ(kNumRequests, server.num_requests.load());
+    tpUnwatchFd(pool, connection.server);
+    tpDestroyPool(pool);
+}
+TEST_F(TaskPoolTasks, CompletionEventSignalsWhenCompletionReachesZero)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    TaskCompletion completion = 0;
+    int const fd = tpCreateCompletionEvent(pool, &completion);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fd, tpCreateCompletionEvent(pool, &completion));
+
+    int const kTotalTasks = 10 * 1000;
+    std::atomic<int> test_int = {0};
+    for (int ii = 0; ii < kTotalTasks; ++ii) {
+        tpSpawnTask(pool, task_function, &test_int, &completion);
+    }
+    // wait like an external event loop would, without helping the pool
+    while (true) {
+        pollfd poll_fd = { fd, POLLIN, 0 };
+        ASSERT_EQ(1, poll(&poll_fd, 1, 5000));
+        uint64_t num_writes = 0;
+        ASSERT_EQ((ssize_t)sizeof(num_writes), read(fd, &num_writes, sizeof(num_writes)));
+        ASSERT_EQ(1u, num_writes);
+        tpAcknowledgeCompletionEvent(pool, &completion);
+        if (completion == 0) {
+            break;
+        }
+    }
+    ASSERT_EQ(kTotalTasks, test_int.load());
+    tpDestroyCompletionEvent(pool, &completion);
+}
+TEST_F(TaskPoolTasks, CompletionEventBatchesSignals)
+{
+    auto const task_function = [](int, void*) {};
+
+    TaskCompletion completion = 0;
+    int const fd = tpCreateCompletionEvent(pool, &completion);
+    ASSERT_GE(fd, 0);
+    for (int ii = 0; ii < 100; ++ii) {
+        tpSpawnTask(pool, task_function, nullptr, &completion);
+        while (completion != 0) {
+            std::this_thread::yield();
+        }
+    }
+    uint64_t num_writes = 0;
+    ASSERT_EQ((ssize_t)sizeof(num_writes), read(fd, &num_writes, sizeof(num_writes)));
+    ASSERT_EQ(1u, num_writes);
+
+    // acknowledging lets the next drop to zero through
+    tpAcknowledgeCompletionEvent(pool, &completion);
+    tpSpawnTask(pool, task_function, nullptr, &completion);
+    pollfd poll_fd = { fd, POLLIN, 0 };
+    ASSERT_EQ(1, poll(&poll_fd, 1, 5000));
+}
+#endif // defined(__linux__)
 
 }
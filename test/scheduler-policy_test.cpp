@@ -0,0 +1,109 @@
+#if defined(_MSC_VER)
+    #pragma warning(push)
+    #pragma warning(disable:28182) // dereferencing NULL pointer (within Gtest)
+    #include <gtest/gtest.h>
+    #pragma warning(pop)
+#else
+    #include <gtest/gtest.h>
+#endif // #if defined(_MSC_VER)
+#include <vector>
+
+#include "../src/scheduler-policy.hpp"
+
+namespace {
+
+enum {
+    kNumSlots = 7,
+};
+
+/* the victims a thief tries in one round, self included if the policy
+ * returned it */
+template<typename Victims>
+std::vector<int> _Round(SchedulerContext& context, int self)
+{
+    std::vector<int> victims;
+    for (int ii = 0; ii < kNumSlots - 1; ++ii) {
+        victims.push_back(Victims::victim(context, self, kNumSlots, ii));
+    }
+    return victims;
+}
+void _ExpectEveryOtherSlotOnce(std::vector<int> const& victims, int self)
+{
+    std::vector<int> counts(kNumSlots, 0);
+    for (int victim : victims) {
+        ASSERT_GE(victim, 0);
+        ASSERT_LT(victim, kNumSlots);
+        counts[victim]++;
+    }
+    for (int ii = 0; ii < kNumSlots; ++ii) {
+        EXPECT_EQ(ii == self ? 0 : 1, counts[ii]);
+    }
+}
+
+TEST(SchedulerPolicy, RoundRobinStartsAfterTheThief)
+{
+    SchedulerContext context = { 1, 0, nullptr };
+    std::vector<int> const victims = _Round<RoundRobinVictims>(context, 5);
+    std::vector<int> const expected = { 6, 0, 1, 2, 3, 4 };
+    ASSERT_EQ(expected, victims);
+}
+
+TEST(SchedulerPolicy, RandomVictimsVisitEveryOtherThreadOnce)
+{
+    SchedulerContext context = { 0x12345, 0, nullptr };
+    std::vector<int> firsts(kNumSlots, 0);
+    for (int round = 0; round < 100; ++round) {
+        std::vector<int> const victims = _Round<RandomVictims>(context, 3);
+        _ExpectEveryOtherSlotOnce(victims, 3);
+        firsts[victims[0]]++;
+    }
+    // the rounds don't all start at the same victim
+    int num_firsts = 0;
+    for (int count : firsts) {
+        num_firsts += count != 0 ? 1 : 0;
+    }
+    ASSERT_LT(1, num_firsts);
+}
+
+TEST(SchedulerPolicy, CallbacksPickVictimsAndIdling)
+{
+    struct Calls {
+        int victims = 0;
+        int spins = 0;
+    } calls;
+    SchedulerCallbacks callbacks;
+    callbacks.select_victim = [](void* user_data, int thread_id, int num_slots, int attempt) {
+        ((Calls*)user_data)->victims++;
+        // out of range for the last try, which has to come back as a skip
+        return attempt == num_slots - 2 ? num_slots : (thread_id + num_slots - 1 - attempt) % num_slots;
+    };
+    callbacks.keep_spinning = [](void* user_data, int, int idle_rounds) {
+        ((Calls*)user_data)->spins++;
+        return idle_rounds < 2 ? 1 : 0;
+    };
+    callbacks.user_data = &calls;
+
+    SchedulerContext context = { 1, 0, &callbacks };
+    std::vector<int> const victims = _Round<CallbackVictims>(context, 2);
+    std::vector<int> const expected = { 1, 0, 6, 5, 4, 2 };
+    ASSERT_EQ(expected, victims);
+    ASSERT_EQ(kNumSlots - 1, calls.victims);
+
+    ASSERT_TRUE(CallbackIdle::keep_looking(context, 2, 0));
+    ASSERT_TRUE(CallbackIdle::keep_looking(context, 2, 1));
+    ASSERT_FALSE(CallbackIdle::keep_looking(context, 2, 2));
+    ASSERT_EQ(3, calls.spins);
+}
+
+TEST(SchedulerPolicy, SpinningIdlersGiveUpEventually)
+{
+    SchedulerContext context = { 1, 0, nullptr };
+    ASSERT_FALSE(SleepWhenIdle::keep_looking(context, 1, 0));
+    int rounds = 0;
+    while (SpinWhenIdle::keep_looking(context, 1, rounds)) {
+        ++rounds;
+    }
+    ASSERT_EQ((int)SpinWhenIdle::kSpinRounds, rounds);
+}
+
+}
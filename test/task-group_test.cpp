@@ -0,0 +1,178 @@
+#if defined(_MSC_VER)
+    #pragma warning(push)
+    #pragma warning(disable:28182) // dereferencing NULL pointer (within Gtest)
+    #include <gtest/gtest.h>
+    #pragma warning(pop)
+#else
+    #include <gtest/gtest.h>
+#endif // #if defined(_MSC_VER)
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "task-pool/task-group.hpp"
+
+namespace {
+
+struct TaskGroups : public ::testing::Test {
+    void SetUp(void)
+    {
+        pool = tpCreatePool(4, nullptr);
+        ASSERT_NE(nullptr, pool);
+    }
+    void TearDown(void)
+    {
+        tpDestroyPool(pool);
+    }
+
+    TaskPool* pool = nullptr;
+};
+
+TEST_F(TaskGroups, GroupJoinsOnScopeExit)
+{
+    std::atomic<int> count = {0};
+    {
+        tp::TaskGroup group(pool);
+        for (int ii = 0; ii < 1000; ++ii) {
+            group.spawn([&count]() { count.fetch_add(1); });
+        }
+    }
+    ASSERT_EQ(1000, count.load());
+}
+TEST_F(TaskGroups, WaitIncludesNestedGroups)
+{
+    std::atomic<int> count = {0};
+    tp::TaskGroup outer(pool);
+    for (int ii = 0; ii < 16; ++ii) {
+        outer.spawn([&]() {
+            tp::TaskGroup inner(outer);
+            for (int jj = 0; jj < 16; ++jj) {
+                inner.spawn([&count]() { count.fetch_add(1); });
+            }
+        });
+    }
+    outer.wait();
+    ASSERT_EQ(16 * 16, count.load());
+
+    TaskGroupStats const stats = outer.stats();
+    ASSERT_EQ(16u + 16 * 16, stats.num_spawned);
+    ASSERT_EQ(16u + 16 * 16, stats.num_finished);
+    ASSERT_EQ(0u, stats.num_skipped);
+    ASSERT_EQ(1, stats.num_groups);
+}
+TEST_F(TaskGroups, CancellationReachesNestedGroups)
+{
+    tp::TaskGroup outer(pool);
+    tp::TaskGroup inner(outer);
+    ASSERT_FALSE(inner.is_cancelled());
+
+    // hold the workers so the spawned tasks stay queued
+    std::atomic<bool> release = {false};
+    TaskCompletion blockers = 0;
+    auto const block = [](int, void* data) {
+        std::atomic<bool>* release = (std::atomic<bool>*)data;
+        while (!release->load()) {
+            std::this_thread::yield();
+        }
+    };
+    for (int ii = 0; ii < 4; ++ii) {
+        tpSpawnTask(pool, block, &release, &blockers);
+    }
+
+    std::atomic<int> count = {0};
+    auto shared = std::make_shared<int>(0);
+    for (int ii = 0; ii < 100; ++ii) {
+        inner.spawn([&count, shared]() { count.fetch_add(1); });
+    }
+    outer.cancel();
+    ASSERT_TRUE(inner.is_cancelled());
+    tp::TaskGroup late(outer);
+    ASSERT_TRUE(late.is_cancelled());
+
+    release = true;
+    inner.wait();
+    tpWaitForCompletion(pool, &blockers);
+    ASSERT_EQ(0, count.load());
+    // skipped closures were destroyed too
+    ASSERT_EQ(1, shared.use_count());
+
+    TaskGroupStats const stats = outer.stats();
+    ASSERT_EQ(100u, stats.num_spawned);
+    ASSERT_EQ(100u, stats.num_skipped);
+    ASSERT_EQ(3, stats.num_groups);
+}
+TEST_F(TaskGroups, RunningTasksSeeCancellation)
+{
+    std::atomic<bool> started = {false};
+    std::atomic<bool> saw_cancel = {false};
+    tp::TaskGroup group(pool);
+    group.spawn([&]() {
+        started = true;
+        while (!tpIsCancelled()) {
+            std::this_thread::yield();
+        }
+        saw_cancel = true;
+    });
+    while (!started.load()) {
+        std::this_thread::yield();
+    }
+    group.cancel();
+    group.wait();
+    ASSERT_TRUE(saw_cancel.load());
+}
+long _Fib(tp::TaskGroup& parent, int policy, int n)
+{
+    if (n < 2) {
+        return n;
+    }
+    long a = 0;
+    long b = 0;
+    tp::TaskGroup group(parent);
+    group.fork(policy,
+               [&]() { a = _Fib(group, policy, n - 1); },
+               [&]() { b = _Fib(group, policy, n - 2); });
+    group.wait();
+    return a + b;
+}
+TEST_F(TaskGroups, ForkWorksWithEitherPolicy)
+{
+    tp::TaskGroup group(pool);
+    ASSERT_EQ(610, _Fib(group, kSpawnHelpFirst, 15));
+    ASSERT_EQ(610, _Fib(group, kSpawnWorkFirst, 15));
+    ASSERT_EQ(610, _Fib(group, tpGetSpawnPolicy(pool), 15));
+
+    // every fork counts both halves, the one that ran in place included
+    TaskGroupStats const stats = group.stats();
+    uint64_t const num_forks = 987 - 1; // calls with n >= 2 for fib(15)
+    ASSERT_EQ(3 * 2 * num_forks, stats.num_spawned);
+    ASSERT_EQ(stats.num_spawned, stats.num_finished);
+    ASSERT_EQ(0u, stats.num_skipped);
+}
+TEST_F(TaskGroups, CApiGroupCountsTasks)
+{
+    auto const task_function = [](int, void* data) {
+        ((std::atomic<int>*)data)->fetch_add(1);
+    };
+
+    std::atomic<int> count = {0};
+    TaskGroup* group = tpCreateTaskGroup(pool, nullptr);
+    ASSERT_NE(nullptr, group);
+    TaskGroup* child = tpCreateTaskGroup(pool, group);
+    ASSERT_NE(nullptr, child);
+    for (int ii = 0; ii < 100; ++ii) {
+        tpSpawnGroupTask(group, task_function, &count);
+        tpSpawnGroupTask(child, task_function, &count);
+    }
+    tpWaitForTaskGroup(group);
+    ASSERT_EQ(200, count.load());
+
+    tpDestroyTaskGroup(child);
+    TaskGroupStats stats;
+    tpGetTaskGroupStats(group, &stats);
+    ASSERT_EQ(200u, stats.num_spawned);
+    ASSERT_EQ(200u, stats.num_finished);
+    ASSERT_EQ(1, stats.num_groups);
+    tpDestroyTaskGroup(group);
+}
+
+}
@@ -120,5 +120,17 @@ TEST(TaskQueue, StealEmptiesQueue)
     ASSERT_EQ(NULL, queue.steal());
     ASSERT_EQ(0, queue.size());
 }
+TEST(TaskQueue, StealIfOnlyTakesMatchingItem)
+{
+    TaskQueue<kMaxQueueSize> queue;
+    queue.push((struct Task*)0x1);
+    queue.push((struct Task*)0x2);
+    auto const is_two = [](struct Task const* task) { return task == (struct Task*)0x2; };
+    ASSERT_EQ(NULL, queue.steal_if(is_two));
+    ASSERT_EQ(2, queue.size());
+    ASSERT_EQ((struct Task*)0x1, queue.steal());
+    ASSERT_EQ((struct Task*)0x2, queue.steal_if(is_two));
+    ASSERT_EQ(0, queue.size());
+}
 
 }
@@ -0,0 +1,108 @@
+#if defined(_MSC_VER)
+    #pragma warning(push)
+    #pragma warning(disable:28182) // dereferencing NULL pointer (within Gtest)
+    #include <gtest/gtest.h>
+    #pragma warning(pop)
+#else
+    #include <gtest/gtest.h>
+#endif // #if defined(_MSC_VER)
+#include <vector>
+
+#include "../src/timer-wheel.hpp"
+
+namespace {
+
+struct Timer {
+    Timer*      next;
+    uint64_t    deadline;
+    uint64_t    fired_at;
+};
+
+int _Fire(Timer* expired, uint64_t tick)
+{
+    int count = 0;
+    while (expired) {
+        expired->fired_at = tick;
+        expired = expired->next;
+        ++count;
+    }
+    return count;
+}
+
+TEST(TimerWheel, CreateWheel)
+{
+    TimerWheel<Timer> wheel;
+    ASSERT_EQ(0u, wheel.size());
+    ASSERT_EQ(TimerWheel<Timer>::kNoDeadline, wheel.next_deadline());
+    ASSERT_EQ(nullptr, wheel.advance(1000));
+    ASSERT_EQ(1000u, wheel.current_tick());
+}
+TEST(TimerWheel, TimerExpiresAtDeadline)
+{
+    TimerWheel<Timer> wheel;
+    Timer timer = { nullptr, 10, 0 };
+    wheel.insert(&timer);
+    ASSERT_EQ(1u, wheel.size());
+    ASSERT_EQ(10u, wheel.next_deadline());
+    ASSERT_EQ(nullptr, wheel.advance(9));
+    ASSERT_EQ(&timer, wheel.advance(10));
+    ASSERT_EQ(0u, wheel.size());
+}
+TEST(TimerWheel, PastDeadlineExpiresOnNextTick)
+{
+    TimerWheel<Timer> wheel(100);
+    Timer timer = { nullptr, 50, 0 };
+    wheel.insert(&timer);
+    ASSERT_EQ(&timer, wheel.advance(101));
+}
+TEST(TimerWheel, AdvancingPastSeveralDeadlinesExpiresAll)
+{
+    TimerWheel<Timer> wheel;
+    Timer timers[3] = { { nullptr, 5, 0 }, { nullptr, 70, 0 }, { nullptr, 5000, 0 } };
+    for (Timer& timer : timers) {
+        wheel.insert(&timer);
+    }
+    ASSERT_EQ(2, _Fire(wheel.advance(100), 100));
+    ASSERT_EQ(1u, wheel.size());
+    ASSERT_EQ(1, _Fire(wheel.advance(100000), 100000));
+}
+TEST(TimerWheel, TimersCascadeToExactTick)
+{
+    // deadlines on every level and in the overflow list
+    std::vector<uint64_t> const deadlines = {
+        1, 63, 64, 65, 127, 4095, 4096, 4097, 300000, 262144, 16777215,
+        16777216, 16777217, 40000000,
+    };
+    std::vector<Timer> timers(deadlines.size());
+    TimerWheel<Timer> wheel;
+    for (size_t ii = 0; ii < deadlines.size(); ++ii) {
+        timers[ii].deadline = deadlines[ii];
+        wheel.insert(&timers[ii]);
+    }
+    // step straight to each next deadline
+    uint64_t next = wheel.next_deadline();
+    while (next != TimerWheel<Timer>::kNoDeadline) {
+        _Fire(wheel.advance(next), next);
+        next = wheel.next_deadline();
+    }
+    for (size_t ii = 0; ii < deadlines.size(); ++ii) {
+        ASSERT_EQ(deadlines[ii], timers[ii].fired_at);
+    }
+}
+TEST(TimerWheel, TickByTickMatchesDeadlines)
+{
+    std::vector<Timer> timers(500);
+    TimerWheel<Timer> wheel(12345);
+    for (size_t ii = 0; ii < timers.size(); ++ii) {
+        timers[ii].deadline = 12345 + 1 + (ii * 7919) % 20000;
+        wheel.insert(&timers[ii]);
+    }
+    for (uint64_t tick = 12346; tick <= 12345 + 20000; ++tick) {
+        _Fire(wheel.advance(tick), tick);
+    }
+    for (Timer const& timer : timers) {
+        ASSERT_EQ(timer.deadline, timer.fired_at);
+    }
+}
+
+}